@@ -0,0 +1,117 @@
+#include "fs.h"
+#include "disk.h"
+#include "crc32c.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*Measures what the data block checksums cost: the speed of crc32c on its own, and the bandwidth
+of streaming a file through the file system with and without checksums. Usage: bench [disk]*/
+
+#define FILE_MB 128 // size of the streamed file
+#define CHUNK (1 << 20) // bytes per fs_write and fs_read call
+#define RUNS 3 // the best of RUNS runs is reported
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*Returns the rate of crc in MB/s over blocks of bsize bytes.*/
+static double crc_rate(unsigned int (*crc)(unsigned int, const void *, size_t), const char *buf,
+                       size_t bsize)
+{
+    size_t total = (size_t)256 << 20, done;
+    unsigned int sum = 0;
+    double start = now();
+    for (done = 0; done < total; done += bsize)
+        sum ^= crc(0, buf + done % CHUNK, bsize);
+    double secs = now() - start;
+    if (sum == 0x12345678)
+        printf(" "); // keeps the loop from being optimized away
+    return total / secs / (1 << 20);
+}
+
+/*Writes and reads back a file of FILE_MB on a fresh file system and stores the best write and
+read bandwidth in MB/s. Returns -1 on failure.*/
+static int stream(char *disk, int checksums, char *buf, double *wr, double *rd)
+{
+    struct fs_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.block_size = 4096;
+    opts.disk_size = (long long)FILE_MB * 2 << 20;
+    opts.checksums = checksums;
+    if (make_fs_opts(disk, &opts) != 0)
+        return -1;
+
+    int run, i;
+    *wr = *rd = 0;
+    for (run = 0; run < RUNS; run++)
+    {
+        if (mount_fs(disk) != 0)
+            return -1;
+        fs_delete("bench");
+        if (fs_create("bench") != 0)
+            return -1;
+        int fd = fs_open("bench");
+        double start = now();
+        for (i = 0; i < FILE_MB; i++)
+            if (fs_write(fd, buf, CHUNK) != CHUNK)
+                return -1;
+        if (fs_sync() != 0)
+            return -1;
+        double secs = now() - start;
+        if (FILE_MB / secs > *wr)
+            *wr = FILE_MB / secs;
+        fs_close(fd);
+        if (umount_fs(disk) != 0 || mount_fs(disk) != 0) // start the reads with a cold cache
+            return -1;
+
+        fd = fs_open("bench");
+        start = now();
+        for (i = 0; i < FILE_MB; i++)
+            if (fs_read(fd, buf, CHUNK) != CHUNK)
+                return -1;
+        secs = now() - start;
+        if (FILE_MB / secs > *rd)
+            *rd = FILE_MB / secs;
+        fs_close(fd);
+        if (umount_fs(disk) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *disk = argc > 1 ? argv[1] : "bench.img";
+    char *buf = (char *)malloc(CHUNK + 65536);
+    if (buf == NULL)
+        return 1;
+    int i;
+    for (i = 0; i < CHUNK + 65536; i++)
+        buf[i] = rand();
+
+    printf("crc32c (%s):\n", crc32c_impl());
+    size_t bsize;
+    for (bsize = 4096; bsize <= 65536; bsize *= 4)
+        printf("  %5zu-byte blocks: %8.0f MB/s, tables %8.0f MB/s\n", bsize,
+               crc_rate(crc32c, buf, bsize), crc_rate(crc32c_sw, buf, bsize));
+
+    double wr_on, rd_on, wr_off, rd_off;
+    if (stream(disk, -1, buf, &wr_off, &rd_off) != 0 || stream(disk, 0, buf, &wr_on, &rd_on) != 0)
+    {
+        fprintf(stderr, "bench: Streaming through '%s' failed.\n", disk);
+        return 1;
+    }
+    printf("streaming %d MB, 4096-byte blocks:\n", FILE_MB);
+    printf("  write: %8.0f MB/s without checksums, %8.0f MB/s with (%+.1f%%)\n", wr_off, wr_on,
+           (wr_on / wr_off - 1) * 100);
+    printf("  read:  %8.0f MB/s without checksums, %8.0f MB/s with (%+.1f%%)\n", rd_off, rd_on,
+           (rd_on / rd_off - 1) * 100);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,318 @@
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+/******************************************************************************/
+/* CRC32C with the SSE4.2 crc32 instruction on x86-64 and the CRC extension   */
+/* on AArch64 when the CPU has them, and with slicing-by-8 tables otherwise.  */
+/* The hardware kernels run three streams at once to hide the latency of the  */
+/* instruction and join them by shifting a stream's CRC over the bytes of     */
+/* the streams after it, which is a multiplication by a constant power of x.  */
+/* x86-64 CPUs with AVX-512 and VPCLMULQDQ fold 256 bytes per step with       */
+/* carry-less multiplies instead and finish with the crc32 instruction.       */
+/******************************************************************************/
+#define POLY 0x82f63b78u  /* Castagnoli polynomial, bit-reversed */
+#define LONG 8192         /* bytes per stream on long buffers */
+#define SHORT 256         /* bytes per stream on short ones */
+
+typedef unsigned int (*kernel_t)(unsigned int, const unsigned char *, size_t);
+
+static unsigned int table[8][256];
+static unsigned int shift_long[4][256], shift_short[4][256];
+static unsigned long long fold_2048[2], fold_512[2], fold_128[2];
+static kernel_t kernel;
+static const char *kernel_name;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/******************************************************************************/
+/* a * b modulo the polynomial, both bit-reversed */
+static unsigned int multmodp(unsigned int a, unsigned int b)
+{
+  unsigned int m = 1u << 31, p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+  }
+  return p;
+}
+
+/* x^n modulo the polynomial; x^(8 * n) shifts a CRC over n zero bytes */
+static unsigned int xnmodp(size_t n)
+{
+  unsigned int p = 1u << 31, sq = 1u << 30; /* x^0 and x^1 */
+
+  for (; n; n >>= 1) {
+    if (n & 1)
+      p = multmodp(sq, p);
+    sq = multmodp(sq, sq);
+  }
+  return p;
+}
+
+static void make_shift(unsigned int t[4][256], size_t n)
+{
+  unsigned int op = xnmodp(8 * n);
+  int i, k;
+
+  for (k = 0; k < 4; ++k)
+    for (i = 0; i < 256; ++i)
+      t[k][i] = multmodp(op, (unsigned int)i << (8 * k));
+}
+
+static unsigned int shift(unsigned int t[4][256], unsigned int crc)
+{
+  return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+         t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+/******************************************************************************/
+static unsigned int crc_sw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  while (len && ((size_t)p & 7)) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    --len;
+  }
+  while (len >= 8) {
+    unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+    unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+          table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+          table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+/******************************************************************************/
+/* Body of a hardware kernel, given the 8- and 64-bit CRC steps of the CPU. */
+#define KERNEL_BODY(crc8, crc64)                                              \
+  unsigned long long c0 = crc, c1, c2, w;                                     \
+  const unsigned char *end;                                                   \
+                                                                              \
+  while (len && ((size_t)p & 7)) {                                            \
+    c0 = crc8(c0, *p++);                                                      \
+    --len;                                                                    \
+  }                                                                           \
+  while (len >= 3 * LONG) {                                                   \
+    c1 = c2 = 0;                                                              \
+    for (end = p + LONG; p < end; p += 8) {                                   \
+      memcpy(&w, p, 8);                                                       \
+      c0 = crc64(c0, w);                                                      \
+      memcpy(&w, p + LONG, 8);                                                \
+      c1 = crc64(c1, w);                                                      \
+      memcpy(&w, p + 2 * LONG, 8);                                            \
+      c2 = crc64(c2, w);                                                      \
+    }                                                                         \
+    c0 = shift(shift_long, c0) ^ c1;                                          \
+    c0 = shift(shift_long, c0) ^ c2;                                          \
+    p += 2 * LONG;                                                            \
+    len -= 3 * LONG;                                                          \
+  }                                                                           \
+  while (len >= 3 * SHORT) {                                                  \
+    c1 = c2 = 0;                                                              \
+    for (end = p + SHORT; p < end; p += 8) {                                  \
+      memcpy(&w, p, 8);                                                       \
+      c0 = crc64(c0, w);                                                      \
+      memcpy(&w, p + SHORT, 8);                                               \
+      c1 = crc64(c1, w);                                                      \
+      memcpy(&w, p + 2 * SHORT, 8);                                           \
+      c2 = crc64(c2, w);                                                      \
+    }                                                                         \
+    c0 = shift(shift_short, c0) ^ c1;                                         \
+    c0 = shift(shift_short, c0) ^ c2;                                         \
+    p += 2 * SHORT;                                                           \
+    len -= 3 * SHORT;                                                         \
+  }                                                                           \
+  for (; len >= 8; p += 8, len -= 8) {                                        \
+    memcpy(&w, p, 8);                                                         \
+    c0 = crc64(c0, w);                                                        \
+  }                                                                           \
+  while (len--)                                                               \
+    c0 = crc8(c0, *p++);                                                      \
+  return c0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define X86_CRC8(c, b) _mm_crc32_u8((unsigned int)(c), (b))
+#define X86_CRC64(c, w) _mm_crc32_u64((c), (w))
+
+__attribute__((target("sse4.2")))
+static unsigned int crc_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  KERNEL_BODY(X86_CRC8, X86_CRC64)
+}
+
+/* A 128-bit lane holds 128 bits of the message, the first in bit 0. Folding  */
+/* it d bits ahead multiplies its two halves by x^(d + 31) and x^(d - 33)     */
+/* (the product of two bit-reversed operands comes out 33 degrees low) and    */
+/* adds the result to the lane d bits ahead, which leaves the CRC unchanged.  */
+static void make_fold(unsigned long long k[2], int d)
+{
+  k[0] = xnmodp(d + 31);
+  k[1] = xnmodp(d - 33);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+static __m128i fold_xmm(__m128i x, __m128i k, __m128i data)
+{
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                                     _mm_clmulepi64_si128(x, k, 0x11)), data);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+static __m512i fold_zmm(__m512i x, __m512i k, __m512i data)
+{
+  return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                   _mm512_clmulepi64_epi128(x, k, 0x11), data, 0x96);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+static unsigned int crc_fold(unsigned int crc, const unsigned char *p, size_t len)
+{
+  if (len < 256)
+    return crc_hw(crc, p, len);
+
+  __m512i k2048 = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_2048[1], fold_2048[0]));
+  __m512i k512 = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_512[1], fold_512[0]));
+  __m128i k128 = _mm_set_epi64x(fold_128[1], fold_128[0]);
+  __m512i z0 = _mm512_loadu_si512(p), z1 = _mm512_loadu_si512(p + 64);
+  __m512i z2 = _mm512_loadu_si512(p + 128), z3 = _mm512_loadu_si512(p + 192);
+  unsigned long long lo, hi;
+
+  /* starting from crc is the same as starting from 0 with crc added to the */
+  /* first four bytes */
+  z0 = _mm512_xor_si512(z0, _mm512_mask_set1_epi32(_mm512_setzero_si512(), 1, crc));
+  for (p += 256, len -= 256; len >= 256; p += 256, len -= 256) {
+    z0 = fold_zmm(z0, k2048, _mm512_loadu_si512(p));
+    z1 = fold_zmm(z1, k2048, _mm512_loadu_si512(p + 64));
+    z2 = fold_zmm(z2, k2048, _mm512_loadu_si512(p + 128));
+    z3 = fold_zmm(z3, k2048, _mm512_loadu_si512(p + 192));
+  }
+  z1 = fold_zmm(z0, k512, z1);
+  z2 = fold_zmm(z1, k512, z2);
+  z3 = fold_zmm(z2, k512, z3);
+
+  __m128i x = _mm512_extracti32x4_epi32(z3, 0);
+  x = fold_xmm(x, k128, _mm512_extracti32x4_epi32(z3, 1));
+  x = fold_xmm(x, k128, _mm512_extracti32x4_epi32(z3, 2));
+  x = fold_xmm(x, k128, _mm512_extracti32x4_epi32(z3, 3));
+  for (; len >= 16; p += 16, len -= 16)
+    x = fold_xmm(x, k128, _mm_loadu_si128((const __m128i *)p));
+
+  /* what is left has the CRC of the message: the lane, then the tail */
+  lo = _mm_cvtsi128_si64(x);
+  hi = _mm_extract_epi64(x, 1);
+  return crc_hw(_mm_crc32_u64(_mm_crc32_u64(0, lo), hi), p, len);
+}
+
+static int have_hw()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+
+static int have_fold()
+{
+  return have_hw() && __builtin_cpu_supports("avx512f") &&
+         __builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("pclmul");
+}
+
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define ARM_CRC8(c, b) __crc32cb((unsigned int)(c), (b))
+#define ARM_CRC64(c, w) __crc32cd((unsigned int)(c), (w))
+
+__attribute__((target("+crc")))
+static unsigned int crc_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  KERNEL_BODY(ARM_CRC8, ARM_CRC64)
+}
+
+static int have_hw()
+{
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#define have_fold() 0
+#define crc_fold crc_hw
+#define make_fold(k, d) ((void)0)
+
+#else
+#define crc_hw crc_sw
+
+static int have_hw()
+{
+  return 0;
+}
+
+#define have_fold() 0
+#define crc_fold crc_sw
+#define make_fold(k, d) ((void)0)
+#endif
+
+/******************************************************************************/
+static void init()
+{
+  unsigned int i, j, c;
+
+  for (i = 0; i < 256; ++i) {
+    c = i;
+    for (j = 0; j < 8; ++j)
+      c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+    table[0][i] = c;
+  }
+  for (i = 0; i < 256; ++i)
+    for (j = 1; j < 8; ++j)
+      table[j][i] = table[0][table[j - 1][i] & 0xff] ^ (table[j - 1][i] >> 8);
+  make_shift(shift_long, LONG);
+  make_shift(shift_short, SHORT);
+  make_fold(fold_2048, 2048);
+  make_fold(fold_512, 512);
+  make_fold(fold_128, 128);
+
+  if (have_fold()) {
+    kernel = crc_fold;
+    kernel_name = "hardware, carry-less multiply";
+  } else if (have_hw()) {
+    kernel = crc_hw;
+    kernel_name = "hardware";
+  } else {
+    kernel = crc_sw;
+    kernel_name = "software";
+  }
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+  pthread_once(&once, init);
+  return ~kernel(~crc, buf, len);
+}
+
+unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len)
+{
+  pthread_once(&once, init);
+  return ~crc_sw(~crc, buf, len);
+}
+
+const char *crc32c_impl()
+{
+  pthread_once(&once, init);
+  return kernel_name;
+}
@@ -0,0 +1,17 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+#include <stddef.h>
+
+/******************************************************************************/
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+                               /* extend crc (0 to start) over len bytes of   */
+                               /* buf with the Castagnoli polynomial, using   */
+                               /* the CPU's CRC instructions if it has them   */
+unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len);
+                               /* same, always computed with tables           */
+const char *crc32c_impl();     /* the kernel crc32c uses: "hardware",         */
+                               /* "hardware, carry-less multiply" or          */
+                               /* "software"                                  */
+/******************************************************************************/
+
+#endif
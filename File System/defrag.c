@@ -0,0 +1,54 @@
+#include "fs.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*Defragments a disk image offline and reports the fragmentation of every file before and after.
+Usage: defrag disk [file...], where the files default to all of them.*/
+
+static void report(const char *name, struct fs_frag *before, struct fs_frag *after)
+{
+    printf("%-16s %8lld blocks %8lld -> %-8lld runs  score %.3f -> %.3f\n", name, after->blocks,
+           before->extents, after->extents, before->score, after->score);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s disk [file...]\n", argv[0]);
+        return 2;
+    }
+    if (mount_fs(argv[1]) != 0)
+        return 1;
+
+    char **files = argv + 2, **all = NULL;
+    int i, ret = 0;
+    if (argc == 2)
+    {
+        if (fs_listfiles(&all) != 0)
+            return 1;
+        files = all;
+    }
+    struct fs_frag before, after, disk_before;
+    fs_fragmentation(NULL, &disk_before);
+    for (i = 0; files[i] != NULL; i++)
+    {
+        if (fs_fragmentation(files[i], &before) != 0 || fs_defrag(files[i]) != 0 ||
+            fs_fragmentation(files[i], &after) != 0)
+        {
+            ret = 1;
+            continue;
+        }
+        report(files[i], &before, &after);
+    }
+    fs_fragmentation(NULL, &after);
+    report("(disk)", &disk_before, &after);
+
+    for (i = 0; all != NULL && all[i] != NULL; i++)
+        free(all[i]);
+    free(all);
+    if (umount_fs(argv[1]) != 0)
+        return 1;
+    return ret;
+}
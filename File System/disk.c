@@ -3,32 +3,440 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE       /* <linux/fs.h>, pulled in above, has its own */
 
 #include "disk.h"
 
 /******************************************************************************/
 static int active = 0;  /* is the virtual disk open (active) */
 static int handle;      /* file handle to virtual disk       */
+static int backend = DISK_BACKEND_FILE; /* backend used by the next open_disk */
+static char *map;       /* whole disk image under DISK_BACKEND_MMAP, else NULL */
+static size_t map_len;
+static int block_size = BLOCK_SIZE; /* geometry of the open disk, see       */
+static int disk_blocks;             /* disk_set_block_size                  */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define IO_DEPTH   64   /* most requests in flight on the io_uring           */
+#define IO_WORKERS 4    /* threads serving requests without io_uring          */
+
+/* asynchronous engine: every submitted request ends up on the done list,    */
+/* from which block_poll hands it back; pending counts requests submitted    */
+/* but not yet handed back                                                   */
+static int io_kind = DISK_IO_AUTO;   /* requested by disk_set_io_engine      */
+static int io_engine = DISK_IO_AUTO; /* running engine, AUTO if not started  */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+static struct block_req *done_head, *done_tail;
+static int pending;
+
+static struct block_req *work_head, *work_tail; /* DISK_IO_THREADS queue    */
+static pthread_t workers[IO_WORKERS];
+static int nworkers;
+static int io_stop;
+
+static int ring_fd = -1;                        /* DISK_IO_URING state      */
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_len, cq_ring_len, sqes_len;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static int in_ring;                             /* submitted, not reaped    */
+
+/******************************************************************************/
+/* transfer every byte described by iov at offset off, resuming after short   */
+/* transfers; the iovec array is consumed in the process                      */
+static int transfer(int wr, struct iovec *iov, int cnt, off_t off)
+{
+  while (cnt > 0) {
+    ssize_t n = wr ? pwritev(handle, iov, cnt, off) : preadv(handle, iov, cnt, off);
+    if (n <= 0)
+      return -1;
+    off += n;
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --cnt;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+static int check_range(const char *who, int block, int count)
+{
+  if (!active) {
+    fprintf(stderr, "%s: disk not active\n", who);
+    return -1;
+  }
+
+  if ((block < 0) || (count < 0) || (block > disk_blocks - count)) {
+    fprintf(stderr, "%s: block index out of bounds\n", who);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* move count listed blocks, one preadv/pwritev per run of consecutive blocks */
+static int transfer_list(int wr, const char *who, int *blocks, char **bufs, int count)
+{
+  struct iovec iov[IOV_MAX];
+  int i, run;
+
+  for (i = 0; i < count; i += run) {
+    if (check_range(who, blocks[i], 1) < 0)
+      return -1;
+
+    if (map) {
+      if (wr)
+        memcpy(map + (size_t)blocks[i] * block_size, bufs[i], block_size);
+      else
+        memcpy(bufs[i], map + (size_t)blocks[i] * block_size, block_size);
+      run = 1;
+      continue;
+    }
+
+    for (run = 0; i + run < count && run < IOV_MAX; ++run) {
+      if (blocks[i + run] != blocks[i] + run || blocks[i + run] >= disk_blocks)
+        break;
+      iov[run].iov_base = bufs[i + run];
+      iov[run].iov_len = block_size;
+    }
+
+    if (transfer(wr, iov, run, (off_t)blocks[i] * block_size) < 0) {
+      fprintf(stderr, "%s: failed to %s\n", who, wr ? "write" : "read");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* asynchronous engine ********************************************************/
+static void push_done(struct block_req *req)
+{
+  req->next = NULL;
+  if (done_tail)
+    done_tail->next = req;
+  else
+    done_head = req;
+  done_tail = req;
+}
+
+/* carry out a request synchronously */
+static void run_req(struct block_req *req)
+{
+  struct iovec iov;
+  size_t len = (size_t)req->count * block_size;
+  off_t off = (off_t)req->block * block_size;
+
+  if (map) {
+    if (req->write)
+      memcpy(map + off, req->buf, len);
+    else
+      memcpy(req->buf, map + off, len);
+    req->result = 0;
+    return;
+  }
+
+  iov.iov_base = req->buf;
+  iov.iov_len = len;
+  req->result = transfer(req->write, &iov, 1, off);
+}
+
+static void *io_worker(void *arg)
+{
+  struct block_req *req;
+
+  (void)arg;
+  pthread_mutex_lock(&io_lock);
+  for (;;) {
+    while (!work_head && !io_stop)
+      pthread_cond_wait(&io_work, &io_lock);
+    if (!work_head)
+      break;
+    req = work_head;
+    if (!(work_head = req->next))
+      work_tail = NULL;
+
+    pthread_mutex_unlock(&io_lock);
+    run_req(req);
+    pthread_mutex_lock(&io_lock);
+
+    push_done(req);
+    pthread_cond_broadcast(&io_done);
+  }
+  pthread_mutex_unlock(&io_lock);
+
+  return NULL;
+}
+
+static int threads_start()
+{
+  io_stop = 0;
+  for (nworkers = 0; nworkers < IO_WORKERS; ++nworkers)
+    if (pthread_create(&workers[nworkers], NULL, io_worker, NULL))
+      break;
+
+  return nworkers ? 0 : -1;
+}
+
+static int uring_enter(unsigned submit, unsigned wait)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* map the rings of a new io_uring; IORING_OP_READ and IORING_OP_WRITE     */
+/* arrived in the same kernel as IORING_FEAT_RW_CUR_POS, which serves as    */
+/* the test for them                                                        */
+static int uring_start()
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  if ((ring_fd = syscall(__NR_io_uring_setup, IO_DEPTH, &p)) < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    goto fail;
+
+  sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_len > sq_ring_len)
+      sq_ring_len = cq_ring_len;
+    cq_ring_len = 0;
+  }
+
+  sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    goto fail;
+  cq_ring = sq_ring;
+  if (cq_ring_len) {
+    cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      goto fail_sq;
+  }
+  sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail_cq;
+
+  sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+  in_ring = 0;
+
+  return 0;
+
+fail_cq:
+  if (cq_ring_len)
+    munmap(cq_ring, cq_ring_len);
+fail_sq:
+  munmap(sq_ring, sq_ring_len);
+fail:
+  close(ring_fd);
+  ring_fd = -1;
+  return -1;
+}
+
+/* move completions from the ring to the done list; called with io_lock held */
+static void uring_reap()
+{
+  unsigned head = *cq_head;
+
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    struct block_req *req = (struct block_req *)(uintptr_t)cqe->user_data;
+    size_t len = (size_t)req->count * block_size;
+
+    req->result = 0;
+    if (cqe->res < 0) {
+      req->result = -1;
+    } else if ((size_t)cqe->res < len) {
+      /* finish a short transfer synchronously */
+      struct iovec iov;
+      iov.iov_base = req->buf + cqe->res;
+      iov.iov_len = len - cqe->res;
+      req->result = transfer(req->write, &iov, 1,
+                             (off_t)req->block * block_size + cqe->res);
+    }
+    push_done(req);
+    --in_ring;
+    ++head;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* wait for at least one completion on the ring; called with io_lock held */
+static void uring_wait()
+{
+  pthread_mutex_unlock(&io_lock);
+  uring_enter(0, 1);
+  pthread_mutex_lock(&io_lock);
+  uring_reap();
+}
+
+static void uring_queue(struct block_req *req)
+{
+  unsigned tail = *sq_tail;
+  unsigned idx = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = handle;
+  sqe->off = (off_t)req->block * block_size;
+  sqe->addr = (uintptr_t)req->buf;
+  sqe->len = (size_t)req->count * block_size;
+  sqe->user_data = (uintptr_t)req;
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++in_ring;
+}
+
+/* hand the last count queued entries to the kernel; entries it refuses are */
+/* taken back off the ring and carried out synchronously instead; when it   */
+/* is short of resources (EAGAIN, EBUSY) the submission is retried after a  */
+/* completion, as long as some request is in flight to complete             */
+static void uring_submit(unsigned count)
+{
+  unsigned tail, i;
+
+  while (count > 0) {
+    int n = uring_enter(count, 0);
+    if (n > 0)
+      count -= n;
+    else if ((n < 0) && (errno == EINTR))
+      continue;
+    else if ((n == 0) || ((errno != EAGAIN) && (errno != EBUSY)))
+      break;
+    if ((count > 0) && (in_ring == (int)count))
+      break;                    /* nothing in flight: no completion to wait for */
+    if (count > 0)
+      uring_wait();
+  }
+  if (count == 0)
+    return;
+
+  tail = *sq_tail - count;
+  for (i = 0; i < count; ++i) {
+    struct block_req *req;
+    req = (struct block_req *)(uintptr_t)sqes[(tail + i) & *sq_mask].user_data;
+    run_req(req);
+    push_done(req);
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  in_ring -= count;
+}
+
+/* start the engine chosen by disk_set_io_engine; called with io_lock held */
+static int io_start()
+{
+  if ((io_kind != DISK_IO_THREADS) && (uring_start() == 0)) {
+    io_engine = DISK_IO_URING;
+    return 0;
+  }
+
+  if ((io_kind != DISK_IO_URING) && (threads_start() == 0)) {
+    io_engine = DISK_IO_THREADS;
+    return 0;
+  }
+
+  fprintf(stderr, "block_submit: cannot start I/O engine\n");
+  return -1;
+}
+
+/* wait for every request in flight, then shut the engine down; requests    */
+/* still on the done list are forgotten                                     */
+static void io_stop_engine()
+{
+  int i;
+
+  pthread_mutex_lock(&io_lock);
+  if (io_engine == DISK_IO_URING) {
+    while (in_ring > 0)
+      uring_wait();
+    munmap(sqes, sqes_len);
+    if (cq_ring_len)
+      munmap(cq_ring, cq_ring_len);
+    munmap(sq_ring, sq_ring_len);
+    close(ring_fd);
+    ring_fd = -1;
+  } else if (io_engine == DISK_IO_THREADS) {
+    io_stop = 1;
+    pthread_cond_broadcast(&io_work);
+    pthread_mutex_unlock(&io_lock);
+    for (i = 0; i < nworkers; ++i)
+      pthread_join(workers[i], NULL);
+    pthread_mutex_lock(&io_lock);
+    nworkers = 0;
+  }
+  io_engine = DISK_IO_AUTO;
+  done_head = done_tail = NULL;
+  pending = 0;
+  pthread_mutex_unlock(&io_lock);
+}
 
 /******************************************************************************/
 int make_disk(char *name)
 {
-  int f, cnt;
-  char buf[BLOCK_SIZE];
+  return make_disk_geom(name, DISK_BLOCKS, BLOCK_SIZE);
+}
+
+int make_disk_geom(char *name, int nblocks, int bsize)
+{
+  int f;
 
   if (!name) {
     fprintf(stderr, "make_disk: invalid file name\n");
     return -1;
   }
 
+  if ((nblocks <= 0) || (bsize <= 0)) {
+    fprintf(stderr, "make_disk: invalid geometry\n");
+    return -1;
+  }
+
   if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
     perror("make_disk: cannot open file");
     return -1;
   }
 
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-    write(f, buf, BLOCK_SIZE);
+  /* size the image without writing it: unwritten blocks are holes that */
+  /* read back as zeros and take no space until they are written         */
+  if (ftruncate(f, (off_t)nblocks * bsize) < 0) {
+    perror("make_disk: cannot size file");
+    close(f);
+    return -1;
+  }
 
   close(f);
 
@@ -38,6 +446,7 @@ int make_disk(char *name)
 int open_disk(char *name)
 {
   int f;
+  struct stat st;
 
   if (!name) {
     fprintf(stderr, "open_disk: invalid file name\n");
@@ -54,6 +463,32 @@ int open_disk(char *name)
     return -1;
   }
 
+  if (fstat(f, &st) < 0) {
+    perror("open_disk: cannot stat file");
+    close(f);
+    return -1;
+  }
+
+  block_size = BLOCK_SIZE;
+  disk_blocks = st.st_size / block_size;
+
+  if (backend == DISK_BACKEND_MMAP) {
+    if (st.st_size == 0) {
+      fprintf(stderr, "open_disk: disk image is empty\n");
+      close(f);
+      return -1;
+    }
+
+    map_len = st.st_size;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (map == MAP_FAILED) {
+      perror("open_disk: cannot map file");
+      map = NULL;
+      close(f);
+      return -1;
+    }
+  }
+
   handle = f;
   active = 1;
 
@@ -67,6 +502,14 @@ int close_disk()
     return -1;
   }
 
+  io_stop_engine();
+
+  if (map) {
+    msync(map, map_len, MS_SYNC);
+    munmap(map, map_len);
+    map = NULL;
+  }
+
   close(handle);
 
   active = handle = 0;
@@ -74,52 +517,217 @@ int close_disk()
   return 0;
 }
 
-int block_write(int block, char *buf)
+int disk_set_block_size(int bsize)
 {
+  struct stat st;
+
   if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
+    fprintf(stderr, "disk_set_block_size: disk not active\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
+  if ((bsize <= 0) || fstat(handle, &st) < 0) {
+    fprintf(stderr, "disk_set_block_size: invalid block size\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
+  block_size = bsize;
+  disk_blocks = st.st_size / block_size;
+
+  return 0;
+}
+
+int disk_set_backend(int kind)
+{
+  if ((kind != DISK_BACKEND_FILE) && (kind != DISK_BACKEND_MMAP)) {
+    fprintf(stderr, "disk_set_backend: unknown backend\n");
     return -1;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
+  backend = kind;
+
+  return 0;
+}
+
+int disk_sync()
+{
+  if (!active) {
+    fprintf(stderr, "disk_sync: disk not active\n");
+    return -1;
+  }
+
+  if (map ? msync(map, map_len, MS_SYNC) : fsync(handle)) {
+    perror("disk_sync: failed to sync");
     return -1;
   }
 
   return 0;
 }
 
+int block_write(int block, char *buf)
+{
+  return block_write_range(block, 1, buf);
+}
+
 int block_read(int block, char *buf)
 {
-  if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
+  return block_read_range(block, 1, buf);
+}
+
+int block_write_range(int block, int count, char *buf)
+{
+  struct iovec iov;
+
+  if (check_range("block_write", block, count) < 0)
     return -1;
+
+  if (map) {
+    memcpy(map + (size_t)block * block_size, buf, (size_t)count * block_size);
+    return 0;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
+  iov.iov_base = buf;
+  iov.iov_len = (size_t)count * block_size;
+  if (transfer(1, &iov, 1, (off_t)block * block_size) < 0) {
+    perror("block_write: failed to write");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  return 0;
+}
+
+int block_read_range(int block, int count, char *buf)
+{
+  struct iovec iov;
+
+  if (check_range("block_read", block, count) < 0)
     return -1;
+
+  if (map) {
+    memcpy(buf, map + (size_t)block * block_size, (size_t)count * block_size);
+    return 0;
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
+  iov.iov_base = buf;
+  iov.iov_len = (size_t)count * block_size;
+  if (transfer(0, &iov, 1, (off_t)block * block_size) < 0) {
     perror("block_read: failed to read");
     return -1;
   }
 
   return 0;
+}
+
+int block_writev(int *blocks, char **bufs, int count)
+{
+  return transfer_list(1, "block_writev", blocks, bufs, count);
+}
+
+int block_readv(int *blocks, char **bufs, int count)
+{
+  return transfer_list(0, "block_readv", blocks, bufs, count);
+}
+
+int disk_set_io_engine(int kind)
+{
+  if ((kind != DISK_IO_AUTO) && (kind != DISK_IO_URING) && (kind != DISK_IO_THREADS)) {
+    fprintf(stderr, "disk_set_io_engine: unknown engine\n");
+    return -1;
+  }
+
+  io_kind = kind;
+
+  return 0;
+}
+
+int disk_io_engine()
+{
+  return io_engine;
+}
+
+int block_submit(struct block_req **reqs, int count)
+{
+  int i;
+  unsigned queued = 0;
+
+  if (!active) {
+    fprintf(stderr, "block_submit: disk not active\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&io_lock);
+  if ((io_engine == DISK_IO_AUTO) && (io_start() < 0)) {
+    pthread_mutex_unlock(&io_lock);
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    struct block_req *req = reqs[i];
+
+    ++pending;
+    if ((req->count <= 0) || (check_range("block_submit", req->block, req->count) < 0)) {
+      req->result = -1;
+      push_done(req);
+    } else if (map) {
+      /* a memcpy gains nothing from being deferred */
+      run_req(req);
+      push_done(req);
+    } else if (io_engine == DISK_IO_URING) {
+      if (in_ring == IO_DEPTH) {
+        uring_submit(queued);
+        queued = 0;
+        while (in_ring == IO_DEPTH)
+          uring_wait();
+      }
+      uring_queue(req);
+      ++queued;
+    } else {
+      req->next = NULL;
+      if (work_tail)
+        work_tail->next = req;
+      else
+        work_head = req;
+      work_tail = req;
+      pthread_cond_signal(&io_work);
+    }
+  }
+
+  if (queued)
+    uring_submit(queued);
+
+  pthread_cond_broadcast(&io_done);
+  pthread_mutex_unlock(&io_lock);
+
+  return 0;
+}
+
+int block_poll(struct block_req **done, int max, int min)
+{
+  int n = 0;
+
+  pthread_mutex_lock(&io_lock);
+  if (min > pending)
+    min = pending;
+  if (min > max)
+    min = max;
+
+  for (;;) {
+    if (io_engine == DISK_IO_URING)
+      uring_reap();
+    while ((n < max) && done_head) {
+      done[n++] = done_head;
+      if (!(done_head = done_head->next))
+        done_tail = NULL;
+      --pending;
+    }
+    if (n >= min)
+      break;
+    if (io_engine == DISK_IO_URING)
+      uring_wait();
+    else
+      pthread_cond_wait(&io_done, &io_lock);
+  }
+  pthread_mutex_unlock(&io_lock);
+
+  return n;
 }
\ No newline at end of file
@@ -2,18 +2,63 @@
 #define _DISK_H_
 
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
+#define DISK_BLOCKS  8192      /* default number of blocks on the disk        */
+#define BLOCK_SIZE   4096      /* default block size on "disk"                */
+
+#define DISK_BACKEND_FILE 0    /* blocks moved with pread/pwrite (default)    */
+#define DISK_BACKEND_MMAP 1    /* whole image mapped, blocks moved by memcpy  */
+
+#define DISK_IO_AUTO    0      /* io_uring if the kernel has it, else threads */
+#define DISK_IO_URING   1      /* asynchronous requests through io_uring      */
+#define DISK_IO_THREADS 2      /* asynchronous requests on worker threads     */
+
+/* an asynchronous request for count consecutive blocks starting at block;    */
+/* buf must stay valid until the request comes back from block_poll           */
+struct block_req {
+  int block;                   /* first block                                 */
+  int count;                   /* number of blocks                            */
+  char *buf;                   /* count * block size bytes                    */
+  int write;                   /* write buf if set, else read into it         */
+  int result;                  /* 0 on success, -1 on failure, once complete  */
+  void *data;                  /* caller's cookie, left untouched             */
+  struct block_req *next;      /* owned by the I/O engine                     */
+};
 
 /******************************************************************************/
 int make_disk(char *name);     /* create an empty, virtual disk file          */
+int make_disk_geom(char *name, int nblocks, int bsize);
+                               /* same, with nblocks blocks of bsize bytes    */
 int open_disk(char *name);     /* open a virtual disk (file)                  */
 int close_disk();              /* close a previously opened disk (file)       */
+int disk_set_backend(int kind);/* backend used by subsequent open_disk calls  */
+int disk_set_block_size(int bsize);
+                               /* block size of the open disk; open_disk      */
+                               /* starts out with BLOCK_SIZE                  */
+int disk_sync();               /* make all written blocks durable             */
 
 int block_write(int block, char *buf);
-                               /* write a block of size BLOCK_SIZE to disk    */
+                               /* write one block to disk                     */
 int block_read(int block, char *buf);
-                               /* read a block of size BLOCK_SIZE from disk   */
+                               /* read one block from disk                    */
+int block_write_range(int block, int count, char *buf);
+                               /* write count consecutive blocks from buf     */
+int block_read_range(int block, int count, char *buf);
+                               /* read count consecutive blocks into buf      */
+int block_writev(int *blocks, char **bufs, int count);
+                               /* write listed blocks from separate buffers   */
+int block_readv(int *blocks, char **bufs, int count);
+                               /* read listed blocks into separate buffers    */
+
+int disk_set_io_engine(int kind);
+                               /* engine started by the next block_submit     */
+int disk_io_engine();          /* engine in use, DISK_IO_AUTO if none yet     */
+int block_submit(struct block_req **reqs, int count);
+                               /* queue count requests without waiting; once  */
+                               /* it returns 0, each of them comes back from  */
+                               /* block_poll exactly once                     */
+int block_poll(struct block_req **done, int max, int min);
+                               /* collect up to max completed requests,       */
+                               /* waiting until at least min are complete     */
 /******************************************************************************/
 
 #endif
\ No newline at end of file
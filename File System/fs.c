@@ -1,49 +1,2408 @@
 #include "fs.h"
 #include "disk.h"
+#include "crc32c.h"
+#include "lz.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 
 
 #define MAX_FD 32
-#define MAX_FILES 64
 #define MAX_F_NAME 15
+#define CACHE_BLOCKS 256 // default size of the block cache, in blocks
+#define EXTENT_BLOCKS 16 // default extent length for FS_ALLOC_EXTENT
+#define IO_BATCH 64      // most blocks moved by one vectored disk request
+#define RA_MIN 4         // first read-ahead window, in blocks
+#define RA_MAX 64        // largest read-ahead window, at most IO_BATCH
+#define FS_MAGIC 0x46415431 // "FAT1", identifies a formatted disk
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define MIN_DISK_SIZE (64 * 1024)
+#define MAX_DISK_BLOCKS (1 << 30) // keeps block numbers and FAT offsets within an int
+#define JOURNAL_BLOCKS 256 // default journal length, capped at 1/16 of the disk
+#define JNL_TX_BYTES (1 << 20) // most bytes of one journal transaction, staged in memory
+#define JNL_MAGIC 0x4a4e4c31 // "JNL1", journal header
+#define TX_MAGIC 0x54584e31  // "TXN1", transaction descriptor
+#define LIDX_UNWRITTEN 0x40000000 // LIDX flag: block preallocated by fs_fallocate, reads as zeros
+#define LIDX_COMP 0x20000000      // LIDX flag: block holds part of a compressed cluster
+#define MAX_FILE_BLOCKS LIDX_COMP // most blocks in a file, so block indices stay clear of the flags
+#define MAX_CLUSTER 16            // most blocks in a compression cluster
+#define MAX_DEDUP 16              // most FAT entries per data block on a dedup disk
 
 struct super_block
 {
+    int magic;       // FS_MAGIC
+    int block_size;  // Bytes per block
+    int disk_blocks; // Blocks on the disk
     int fat_idx;  // First block of the FAT
     int fat_len;  // Length of FAT in blocks
-    int dir_idx;  // First block of directory
+    int dir_head; // First data block of the directory chain
     int dir_len;  // Length of directory in blocks
     int data_idx; // First block of file-data
+    int alloc_policy;  // FS_ALLOC_FIRST_FIT or FS_ALLOC_EXTENT
+    int extent_blocks; // Length of the runs reserved under FS_ALLOC_EXTENT
+    int dir_cap;  // Number of directory entries, dir_len * DIR_PER_BLOCK
+    int jnl_idx;  // First block of the metadata journal
+    int jnl_len;  // Length of the journal in blocks, 0 if there is none
+    int lidx_idx; // First block of the logical index table
+    int lidx_len; // Length of the logical index table, 0 on disks formatted without one
+    int comp_cluster; // Blocks per compression cluster, 0 if file data is stored raw
+    int csum_idx; // First block of the checksum table
+    int csum_len; // Length of the checksum table, 0 if data blocks carry no checksums
+    int nodes;    // FAT entries chains may use, 0 for one per data block
+    int pmap_idx; // First block of the block map
+    int pmap_len; // Length of the block map, 0 unless identical data blocks are shared
+};
+
+/*The journal starts with a header block; transactions follow it back to back. A transaction is
+a descriptor listing the home blocks of the metadata images that follow it; a descriptor that
+lists more images than one block holds runs on into the next blocks. A transaction takes at
+most JNL_TX_BYTES, so a commit is a run of transactions, all but the last marked more. Replay
+starts at the header's sequence number, stops at the first descriptor whose magic, sequence
+number or checksum (over the descriptor and the images) does not match, and applies only the
+commits whose last transaction it reached. The journal is long enough for one commit to carry
+every table block, the super block and the directory blocks a commit can hold (jnl_room).*/
+struct jnl_header
+{
+    int magic; // JNL_MAGIC
+    int seq;   // sequence number of the first transaction to replay
+};
+
+struct jnl_desc
+{
+    int magic;        // TX_MAGIC
+    int seq;          // one more than the previous transaction
+    int count;        // number of images following the descriptor
+    int more;         // 1 if the commit goes on in the next transaction
+    unsigned int crc; // crc32c of the descriptor, with crc = 0, and the images
+    int target[];     // home block of each image
 };
 
 struct dir_entry
 {
     int used;                  // Is this file-”slot” in use
     char name[MAX_F_NAME + 1]; // DOH!
-    int size;                  // file size
+    long long size;            // file size
     int head;                  // first data block of file
     int ref_cnt;
     // how many open file descriptors are there?
     // ref_cnt > 0 -> cannot delete file
+    int spare[6];              // pads the entry to 64 bytes, which divides every block size
+};
+
+#define DIR_PER_BLOCK ((int)(fs.block_size / sizeof(struct dir_entry)))
+
+struct file_descriptor
+{
+    int used; // fd in use
+    int file; // the first block of the file
+    // (f) to which fd refers too
+    off_t offset; // position of fd within f
+    int cur_block; // block last reached through the FAT, -1 if none
+    int cur_idx;   // logical index of cur_block within the file
+    off_t ra_next; // offset a sequential read would continue from
+    int ra_window; // read-ahead window in blocks, 0 while access looks random
+    int ra_end;    // block index up to which blocks have been read ahead
+    pthread_mutex_t lock; // held for the whole of every call made on the descriptor
+};
+
+struct super_block fs;
+struct file_descriptor fildesA[MAX_FD]; // 32
+int *FAT;                               // Will be populated with the FAT data
+struct dir_entry *DIR;                  // Will be populated with the directory data
+
+/*Locking. Calls on a descriptor hold its lock throughout. ns_lock guards the directory as a
+whole (its size, the name index, ref_cnt) and the metadata written by fs_sync: creating,
+deleting, opening, closing and syncing hold it exclusively, and calls on open files share it.
+Those also take the reader/writer lock of their file, shared to read and exclusive to change
+it, and meta_lock around changes to the FAT, the bitmap and the dirty flags. The block cache
+has its own lock. Locks are taken in that order: descriptor, ns_lock, file, meta_lock, cache.*/
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t *file_lock; // one per directory slot
+static int file_lock_cnt;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*The directory is a FAT chain of data blocks starting at fs.dir_head that grows by one block
+whenever fs_create runs out of free slots. dir_blocks lists the chain in order.*/
+static int *dir_blocks;
+
+/*Files may be sparse, so a chain lists only the blocks that hold data, in file order, and LIDX
+gives the logical index of each block within its file; a missing index is a hole, which reads
+back as zeros. LIDX parallels the FAT and lives in its own region after it. Disks formatted
+before that region existed get a dense LIDX built at mount_fs and cannot hold holes. Blocks that
+fs_fallocate reserved carry LIDX_UNWRITTEN until their first write and read back as zeros.
+
+On a compressed disk the logical blocks of a file are grouped into clusters of comp_cluster
+blocks, and each cluster is stored on its own: all-zero clusters as a hole, clusters that
+compress to fewer blocks than they take raw as the compressed stream, and the others as their
+non-zero blocks. The blocks of a compressed cluster carry LIDX_COMP and consecutive indices from
+the first of the cluster; the first of them starts with the length of the stream.*/
+static int *LIDX;
+
+/*CRC32C of every file data block, indexed like LIDX and kept in its own region after it. A data
+write updates the checksums of its blocks and then writes the table blocks holding them, so the
+table never lags behind the data by more than a write interrupted by a crash; blocks read from
+the disk are checked against it. csum_lock orders the writes of the table.*/
+static unsigned int *CSUM;
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Deduplication. On a disk formatted with it, chains are made of FAT entries that are no longer
+data blocks themselves, and there may be more of them than data blocks: PMAP, a region after the
+checksum table, maps every entry in use to the data block holding its contents. Entries with
+identical contents share one data block, and REFS counts the entries mapped to each data block,
+0 for a free one. The cache and everything above data_readv and data_writev still number blocks
+by FAT entry; those two translate them.
+
+Data blocks are found by contents through the fingerprint index, a hash table on their CRC32C
+in CSUM whose buckets in fp_head are chained through fp_next (-2 for blocks outside the index).
+Every data block written is entered, and a block in the index is not written again while
+another entry could share it: an entry whose block is shared gets a new one when it is written
+(copy-on-write), and a block is taken out of the index before it is overwritten in place. REFS
+and the index are rebuilt at mount_fs. dedup_lock guards all of it; it is taken after every
+other lock and never held across I/O.*/
+static int *PMAP;
+static int *REFS;
+static int *fp_head;
+static int *fp_next;
+static int fp_buckets;
+static int phys_free; // data blocks with no entry mapped to them
+static int phys_hint; // data block where the next search for a free one starts
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Metadata blocks changed since they were last written: one flag per FAT, LIDX, PMAP and
+directory block, plus the super block. fs_sync and umount_fs write only these.*/
+static unsigned char *fat_dirty;
+static unsigned char *lidx_dirty;
+static unsigned char *pmap_dirty;
+static unsigned char *dir_dirty;
+static int dir_dirty_cnt; // flags set in dir_dirty
+static int super_dirty;
+
+/*Journal state. jnl_tx stages one transaction at a time, and a checkpoint reads the journal
+back through it; jnl_home gives the home block of each journal block written since the last
+checkpoint (-1 for header and descriptor blocks).*/
+static char *jnl_tx;
+static int *jnl_home;
+static int jnl_head; // next free journal block, relative to fs.jnl_idx
+static int jnl_seq;  // sequence number of the next transaction
+
+/*Write-back block cache between the file system and block_read/block_write. Slots are found
+through a hash on the block number and kept on an LRU list; dirty slots are written back when
+they are evicted, on fs_flush and on umount_fs.*/
+struct cache_entry
+{
+    int block;      // disk block held by this slot, -1 if the slot is empty
+    int dirty;      // slot has been modified since it was read from disk
+    int fresh;      // dirty, and the block holds no data of its file on disk yet
+    int prev, next; // LRU list, lru_head is the most recently used slot
+    int hnext;      // next slot in the same hash bucket
+    int file;       // directory slot of the file that dirtied the slot
+    int busy;       // an asynchronous read into data is in flight
+    int unchecked;  // data was read ahead and is matched against its checksum on first use
+    struct block_req req;
+    char *data;
+};
+
+static int cache_size = CACHE_BLOCKS; // capacity in blocks, 0 disables the cache
+static struct cache_entry *cache;
+static char *cache_mem;
+static int *cache_hash;
+static int cache_buckets;
+static int lru_head = -1, lru_tail = -1;
+
+/*Free-space bitmap over the data blocks (bit set = block in use) and the last block of every
+file. Both are rebuilt from the directory and the FAT chains at mount_fs.*/
+static unsigned char *used_map;
+static int free_blocks; // bits clear in used_map
+static int alloc_hint;  // byte of used_map where the next allocation search starts
+static int *tail_block;
+
+/*A block freed since the last metadata commit may still belong to a file in the committed
+metadata, which a crash brings back; reused before the commit, it would bring that file back
+holding another file's data. Such blocks are marked in freed_map and kept from the allocator
+until sync_meta has committed (release_freed). Blocks taken since the commit, marked in
+taken_map, belong to no committed file and are free again at once. Both maps are over data
+blocks, which are the FAT entries except on a dedup disk, and are guarded by meta_lock, or by
+dedup_lock on a dedup disk. On a dedup disk freed_map also marks blocks that only lost a
+reference, which must not be overwritten in place either.*/
+static unsigned char *freed_map;
+static unsigned char *taken_map;
+static int freed_cnt; // blocks in freed_map that no file uses any more
+
+/*Under FS_ALLOC_EXTENT every file with open descriptors may own a reserved run of free blocks
+[next, end). Reserved blocks are marked used in the bitmap but are not on any chain until the
+file grows into them; the rest is released when the file is closed or truncated.*/
+struct extent_resv
+{
+    int next;
+    int end;
+};
+static struct extent_resv *resv;
+static int extent_hint; // block where the next-fit search for a free run starts
+
+/*Delayed allocation (fs_set_delalloc). A partial write to a block the file does not have yet is
+kept in a block-sized buffer of the file instead; the block is allocated and written when the
+buffer fills up, and on fs_close, fs_flush and fs_sync. Each file buffers at most one block and
+buffers are flushed on close, so they hold at most MAX_FD blocks between them. On a compressed
+disk every partial write of a cluster goes through such a buffer, which then holds the whole
+cluster and is compressed when it is flushed.
+
+A buffer sets aside the free blocks its flush can need when it is created, so a write that was
+buffered cannot fail for lack of space later. dalloc_resv counts the blocks set aside, which
+other allocations leave alone (room_for); on a dedup disk it counts both FAT entries and data
+blocks. It is changed under meta_lock and dedup_lock both, so either lock is enough to read it.*/
+struct delalloc
+{
+    int idx;    // logical block, or cluster on a compressed disk, held in data
+    char *data; // block or cluster image, NULL if nothing is buffered
+    int resv;   // blocks set aside for this buffer
 };
 
-struct file_descriptor
-{
-    int used; // fd in use
-    int file; // the first block of the file
-    // (f) to which fd refers too
-    int offset; // position of fd within f
-};
+static int delalloc_on;
+static struct delalloc *dalloc; // one per directory slot
+static int dalloc_cnt;          // buffers in use, guarded by meta_lock
+static int dalloc_resv;         // blocks set aside by all buffers
+
+/*In-memory index of the directory: a hash table from file name to directory slot, chained
+through dir_hnext, and a stack of free slots for fs_create. Rebuilt at mount_fs.*/
+static int *dir_hash;
+static int dir_buckets;
+static int *dir_hnext;
+static int *free_slots;
+static int nfree_slots;
+#define DATA_BLOCKS (fs.disk_blocks - fs.data_idx)
+#define NODES (fs.nodes ? fs.nodes : DATA_BLOCKS) // FAT entries available to chains
+
+static void lru_unlink(int slot)
+{
+    struct cache_entry *e = &cache[slot];
+    if (e->prev != -1)
+        cache[e->prev].next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next != -1)
+        cache[e->next].prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+static void lru_push(int slot)
+{
+    cache[slot].prev = -1;
+    cache[slot].next = lru_head;
+    if (lru_head != -1)
+        cache[lru_head].prev = slot;
+    lru_head = slot;
+    if (lru_tail == -1)
+        lru_tail = slot;
+}
+
+static void hash_remove(int slot)
+{
+    int *link = &cache_hash[cache[slot].block % cache_buckets];
+    while (*link != -1)
+    {
+        if (*link == slot)
+        {
+            *link = cache[slot].hnext;
+            break;
+        }
+        link = &cache[*link].hnext;
+    }
+    cache[slot].hnext = -1;
+}
+
+/*Checks a data block that was just read from disk against its checksum, reporting a mismatch as
+who's. block is a disk block.*/
+static int csum_verify(int block, const char *buf, const char *who)
+{
+    if (fs.csum_len == 0 || block < fs.data_idx)
+        return 0;
+    if (crc32c(0, buf, fs.block_size) == CSUM[block - fs.data_idx])
+        return 0;
+    fprintf(stderr, "%s: Checksum mismatch in block %d, the block is torn or corrupted.\n", who,
+            block);
+    return -1;
+}
+
+/*Records the checksums crc of count data blocks that were just written and writes the table
+blocks holding them.*/
+static int csum_store(const int *blocks, const unsigned int *crc, int count)
+{
+    if (fs.csum_len == 0 || count == 0)
+        return 0;
+    int table[count];
+    char *tbufs[count];
+    int per = fs.block_size / sizeof(int);
+    int i, j, n = 0;
+
+    pthread_mutex_lock(&csum_lock);
+    for (i = 0; i < count; i++)
+    {
+        int b = blocks[i] - fs.data_idx;
+        CSUM[b] = crc[i];
+        for (j = 0; j < n && table[j] != fs.csum_idx + b / per; j++)
+            ;
+        if (j == n) // blocks are mostly in order, so this list stays short
+        {
+            table[n] = fs.csum_idx + b / per;
+            tbufs[n++] = (char *)(CSUM + (size_t)(b / per) * per);
+        }
+    }
+    int ret = block_writev(table, tbufs, n);
+    pthread_mutex_unlock(&csum_lock);
+    return ret;
+}
+
+static int csum_update(const int *blocks, char **bufs, int count)
+{
+    if (fs.csum_len == 0 || count == 0)
+        return 0;
+    unsigned int crc[count];
+    int i;
+    for (i = 0; i < count; i++)
+        crc[i] = crc32c(0, bufs[i], fs.block_size);
+    return csum_store(blocks, crc, count);
+}
+
+/*Returns the disk block holding block, a data block numbered by FAT entry, or -1 if the entry
+has none.*/
+static int data_block(int block)
+{
+    if (fs.pmap_len == 0 || block < fs.data_idx)
+        return block;
+    pthread_mutex_lock(&dedup_lock);
+    int p = PMAP[block - fs.data_idx];
+    pthread_mutex_unlock(&dedup_lock);
+    return p == -1 ? -1 : fs.data_idx + p;
+}
+
+static void pmap_set(int block, int p)
+{
+    PMAP[block] = p;
+    pmap_dirty[block / (fs.block_size / sizeof(int))] = 1;
+}
+
+static void fp_insert(int p)
+{
+    int b = CSUM[p] % fp_buckets;
+    fp_next[p] = fp_head[b];
+    fp_head[b] = p;
+}
+
+static void fp_remove(int p)
+{
+    if (fp_next[p] == -2)
+        return;
+    int *link = &fp_head[CSUM[p] % fp_buckets];
+    while (*link != p)
+        link = &fp_next[*link];
+    *link = fp_next[p];
+    fp_next[p] = -2;
+}
+
+/*Records that a file gave up data block b, unless b was taken since the last commit. Returns 1
+if it was recorded; b must then stay out of the allocator until the next commit, and the caller
+counts it in freed_cnt once no file uses it.*/
+static int hold_freed(int b)
+{
+    if (taken_map[b / 8] & (1 << (b % 8)))
+        return 0;
+    freed_map[b / 8] |= 1 << (b % 8);
+    return 1;
+}
+
+static int held(int b)
+{
+    return freed_map[b / 8] & (1 << (b % 8));
+}
+
+static void mark_taken(int b)
+{
+    taken_map[b / 8] |= 1 << (b % 8);
+}
+
+/*Reports that who ran out of space, unless blocks freed since the last commit are held: the
+caller then commits and tries again (write_retry), and reports only if that fails too. Called
+without meta_lock and dedup_lock.*/
+static void no_space(const char *who)
+{
+    pthread_mutex_t *lock = fs.pmap_len > 0 ? &dedup_lock : &meta_lock;
+    pthread_mutex_lock(lock);
+    int held_cnt = freed_cnt;
+    pthread_mutex_unlock(lock);
+    if (held_cnt == 0)
+        fprintf(stderr, "%s: No space left on disk.\n", who);
+}
+
+/*Drops one reference to data block p, which is freed with the last one; with wait set it then
+waits for the next commit.*/
+static void phys_drop(int p, int wait)
+{
+    if (--REFS[p] > 0)
+        return;
+    fp_remove(p);
+    if (wait)
+        freed_cnt++;
+    else
+        phys_free++;
+}
+
+/*Drops the reference of an entry that gives up data block p. A block that lost a reference since
+the last commit may still be shared in the committed metadata, so it is not overwritten in place
+(dedup_writev), and once free it waits for the commit.*/
+static void phys_put(int p)
+{
+    phys_drop(p, hold_freed(p));
+}
+
+/*Takes a free data block, goal if it is free, and gives it one reference. Returns -1 when there
+is none.*/
+static int phys_alloc(int goal)
+{
+    int n, p = goal;
+    if (phys_free <= dalloc_resv)
+        return -1;
+    for (n = 0; p >= DATA_BLOCKS || REFS[p] != 0 || held(p); n++)
+        p = (phys_hint + n) % DATA_BLOCKS;
+    REFS[p] = 1;
+    mark_taken(p);
+    phys_free--;
+    phys_hint = p + 1;
+    return p;
+}
+
+/*Takes a run of len free data blocks, each with one reference, and returns the first, or -1 if
+there is no such run.*/
+static int phys_run(int len)
+{
+    int p, count = 0;
+    if (phys_free - dalloc_resv < len)
+        return -1;
+    for (p = 0; p < DATA_BLOCKS && count < len; p++)
+        count = REFS[p] == 0 && !held(p) ? count + 1 : 0;
+    if (count < len)
+        return -1;
+    int start = p - len;
+    for (p = start; p < start + len; p++)
+    {
+        REFS[p] = 1;
+        mark_taken(p);
+    }
+    phys_free -= len;
+    return start;
+}
+
+/*Gives the FAT entry block a data block of its own, the one with its number when it is free.*/
+static int phys_attach(int block)
+{
+    pthread_mutex_lock(&dedup_lock);
+    int p = phys_alloc(block);
+    if (p != -1)
+        pmap_set(block, p);
+    pthread_mutex_unlock(&dedup_lock);
+    return p == -1 ? -1 : 0;
+}
+
+/*Gives each of the count FAT entries in blocks whose data block is shared, now or in the
+committed metadata, a free data block of its own, so that new contents can be written to all of
+them without taking one; what they held is dropped. Returns -1, changing nothing, if there are
+not enough free data blocks.*/
+static int phys_own(const int *blocks, int count)
+{
+    int i, need = 0;
+    pthread_mutex_lock(&dedup_lock);
+    for (i = 0; i < count; i++)
+        if (REFS[PMAP[blocks[i]]] > 1 || held(PMAP[blocks[i]]))
+            need++;
+    int ok = phys_free - dalloc_resv >= need;
+    for (i = 0; ok && i < count; i++)
+    {
+        int p = PMAP[blocks[i]];
+        if (REFS[p] > 1 || held(p))
+        {
+            pmap_set(blocks[i], phys_alloc(blocks[i]));
+            phys_put(p);
+        }
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return ok ? 0 : -1;
+}
+
+/*Looks for a data block in the fingerprint index that holds the same bytes as buf, whose
+checksum is crc, reading the candidates into cand to compare them. Returns the block with a
+reference taken on it, or -1 if there is none.*/
+static int dedup_find(unsigned int crc, const char *buf, char *cand)
+{
+    pthread_mutex_lock(&dedup_lock);
+    int p = fp_head[crc % fp_buckets];
+    while (p >= 0)
+    {
+        if (CSUM[p] != crc)
+        {
+            p = fp_next[p];
+            continue;
+        }
+        REFS[p]++; // keeps p from being freed or rewritten while it is compared
+        pthread_mutex_unlock(&dedup_lock);
+        int block = fs.data_idx + p;
+        int same = block_readv(&block, &cand, 1) == 0 && memcmp(cand, buf, fs.block_size) == 0;
+        pthread_mutex_lock(&dedup_lock);
+        if (same)
+            break;
+        int next = fp_next[p];
+        phys_drop(p, held(p)); // no entry gave p up, only the comparison is over
+        p = next;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return p >= 0 ? p : -1;
+}
+
+/*data_writev on a dedup disk. An entry whose new contents are already held by a data block, in
+the fingerprint index or earlier in the same request, is mapped to that block and nothing is
+written for it. Otherwise its data block is overwritten, or replaced by a new one if it is
+shared, and the written blocks enter the index. Returns the number of entries, from the first,
+that hold their new contents: fewer than count if the disk fills up, -1 on an I/O error.*/
+static int dedup_writev(int *blocks, char **bufs, int count)
+{
+    if (count == 0)
+        return 0;
+    unsigned int crc[count], out_crc[count];
+    int out[count];
+    char *out_bufs[count];
+    char cand[fs.block_size];
+    int i, j, n = 0;
+    for (i = 0; i < count; i++)
+        crc[i] = crc32c(0, bufs[i], fs.block_size);
+
+    for (i = 0; i < count; i++)
+    {
+        int entry = blocks[i] - fs.data_idx;
+        int p = -1;
+        for (j = 0; j < n && p == -1; j++)
+        {
+            if (out_crc[j] == crc[i] && memcmp(out_bufs[j], bufs[i], fs.block_size) == 0)
+            {
+                p = out[j] - fs.data_idx;
+                pthread_mutex_lock(&dedup_lock);
+                REFS[p]++;
+                pthread_mutex_unlock(&dedup_lock);
+            }
+        }
+        if (p == -1)
+            p = dedup_find(crc[i], bufs[i], cand);
+
+        pthread_mutex_lock(&dedup_lock);
+        int old = PMAP[entry];
+        if (p != -1) // p already holds the contents, and a reference was taken on it
+        {
+            if (p != old)
+            {
+                pmap_set(entry, p);
+                phys_put(old);
+            }
+            else
+                REFS[p]--; // the entry keeps its block
+            pthread_mutex_unlock(&dedup_lock);
+            continue;
+        }
+        if (REFS[old] == 1 && !held(old))
+        {
+            fp_remove(old); // overwritten in place, and found by no one meanwhile
+            p = old;
+        }
+        else if ((p = phys_alloc(entry)) != -1)
+        {
+            phys_put(old); // shared by another entry, now or in the committed metadata
+            pmap_set(entry, p);
+        }
+        pthread_mutex_unlock(&dedup_lock);
+        if (p == -1)
+        {
+            no_space("fs_write");
+            break;
+        }
+        out[n] = fs.data_idx + p;
+        out_bufs[n] = bufs[i];
+        out_crc[n++] = crc[i];
+    }
+
+    if (n > 0 && (block_writev(out, out_bufs, n) != 0 || csum_store(out, out_crc, n) != 0))
+        return -1;
+    pthread_mutex_lock(&dedup_lock);
+    for (j = 0; j < n; j++)
+        fp_insert(out[j] - fs.data_idx);
+    pthread_mutex_unlock(&dedup_lock);
+    return i;
+}
+
+/*block_readv and block_writev for file data blocks, numbered by FAT entry, which keep their
+checksums. count is at most IO_BATCH; who names the caller in error messages. data_writev
+returns the number of blocks written, which only a full dedup disk makes fewer than count.*/
+static int data_readv(int *blocks, char **bufs, int count, const char *who)
+{
+    int phys[IO_BATCH];
+    int i;
+    for (i = 0; i < count; i++)
+        phys[i] = data_block(blocks[i]);
+    if (block_readv(phys, bufs, count) != 0)
+        return -1;
+    for (i = 0; i < count; i++)
+        if (csum_verify(phys[i], bufs[i], who) != 0)
+            return -1;
+    return 0;
+}
+
+static int data_writev(int *blocks, char **bufs, int count)
+{
+    if (fs.pmap_len > 0)
+        return dedup_writev(blocks, bufs, count);
+    if (block_writev(blocks, bufs, count) != 0 || csum_update(blocks, bufs, count) != 0)
+        return -1;
+    return count;
+}
+
+/*Collects completed read-ahead requests and waits until slot has none in flight. A slot whose
+read failed is emptied; the others are checked against their checksums by cache_check.*/
+static void cache_settle(int slot)
+{
+    struct block_req *done[IO_BATCH];
+    int i, n;
+    while (cache[slot].busy)
+    {
+        n = block_poll(done, IO_BATCH, 1);
+        if (n <= 0)
+        {
+            done[0] = &cache[slot].req;
+            done[0]->result = -1;
+            n = 1;
+        }
+        for (i = 0; i < n; i++)
+        {
+            struct cache_entry *e = &cache[(int)(size_t)done[i]->data];
+            e->busy = 0;
+            e->unchecked = done[i]->result == 0;
+            if (done[i]->result != 0)
+            {
+                hash_remove(e - cache);
+                e->block = -1;
+            }
+        }
+    }
+}
+
+/*Verifies a read-ahead slot the first time it is used rather than when its read completes, so
+the checksum pass runs right before the copy out, while the block is still hot, and blocks read
+ahead but never used cost nothing. Returns slot, or -1 after emptying a slot that fails.*/
+static int cache_check(int slot, const char *who)
+{
+    if (slot == -1 || !cache[slot].unchecked)
+        return slot;
+    cache[slot].unchecked = 0;
+    if (csum_verify(cache[slot].req.block, cache[slot].data, who) == 0)
+        return slot;
+    hash_remove(slot);
+    cache[slot].block = -1;
+    return -1;
+}
+
+static int cache_find(int block)
+{
+    int slot = cache_hash[block % cache_buckets];
+    while (slot != -1 && cache[slot].block != block)
+        slot = cache[slot].hnext;
+    return slot;
+}
+
+/*Returns the slot holding block, once any read into it has completed, or -1.*/
+static int cache_lookup(int block)
+{
+    int slot = cache_find(block);
+    if (slot != -1 && cache[slot].busy)
+    {
+        cache_settle(slot);
+        if (cache[slot].block != block)
+            return -1;
+    }
+    return slot;
+}
+
+static int cache_writeback(int slot)
+{
+    if (!cache[slot].dirty)
+        return 0;
+    if (data_writev(&cache[slot].block, &cache[slot].data, 1) != 1)
+        return -1;
+    cache[slot].dirty = 0;
+    cache[slot].fresh = 0;
+    return 0;
+}
+
+static int cache_init(void)
+{
+    int i;
+    cache = NULL;
+    lru_head = lru_tail = -1;
+    if (cache_size == 0)
+        return 0;
+
+    cache_buckets = cache_size * 2 + 1;
+    cache = (struct cache_entry *)malloc(cache_size * sizeof(struct cache_entry));
+    cache_mem = (char *)malloc((size_t)cache_size * fs.block_size);
+    cache_hash = (int *)malloc(cache_buckets * sizeof(int));
+    if (cache == NULL || cache_mem == NULL || cache_hash == NULL)
+    {
+        free(cache);
+        free(cache_mem);
+        free(cache_hash);
+        cache = NULL;
+        return -1;
+    }
+    for (i = 0; i < cache_buckets; i++)
+        cache_hash[i] = -1;
+    for (i = 0; i < cache_size; i++) // every slot starts empty, on the LRU list
+    {
+        cache[i].block = -1;
+        cache[i].dirty = 0;
+        cache[i].fresh = 0;
+        cache[i].hnext = -1;
+        cache[i].busy = 0;
+        cache[i].unchecked = 0;
+        cache[i].data = cache_mem + (size_t)i * fs.block_size;
+        cache[i].prev = cache[i].next = -1;
+        lru_push(i);
+    }
+    return 0;
+}
+
+static void cache_destroy(void)
+{
+    int i;
+    if (cache == NULL)
+        return;
+    for (i = 0; i < cache_size; i++)
+        cache_settle(i);
+    free(cache);
+    free(cache_mem);
+    free(cache_hash);
+    cache = NULL;
+    lru_head = lru_tail = -1;
+}
+
+/*Returns the slot holding block, loading it from disk when load is set. The least recently used
+slot is recycled on a miss, and written back first if it is dirty. who names the caller in
+error messages.*/
+static int cache_get(int block, int load, const char *who)
+{
+    int slot = cache_check(cache_lookup(block), who);
+    if (slot != -1)
+    {
+        lru_unlink(slot);
+        lru_push(slot);
+        return slot;
+    }
+
+    slot = lru_tail;
+    cache_settle(slot);
+    if (cache[slot].block != -1)
+    {
+        if (cache_writeback(slot) != 0)
+            return -1;
+        hash_remove(slot);
+        cache[slot].block = -1;
+    }
+    if (load && data_readv(&block, &cache[slot].data, 1, who) != 0)
+        return -1;
+
+    cache[slot].block = block;
+    cache[slot].dirty = 0;
+    cache[slot].fresh = 0;
+    cache[slot].unchecked = 0;
+    cache[slot].hnext = cache_hash[block % cache_buckets];
+    cache_hash[block % cache_buckets] = slot;
+    lru_unlink(slot);
+    lru_push(slot);
+    return slot;
+}
+
+/*Copies len bytes from buf to off within block through the cache and marks the block dirty for
+file. A fresh block holds no data on disk yet, so it is zero-filled instead of read.*/
+static int cache_modify(int block, int fresh, size_t off, const char *buf, size_t len, int file,
+                        const char *who)
+{
+    if (cache == NULL)
+    {
+        char block_data[fs.block_size];
+        char *data = block_data;
+        if (fresh)
+            memset(block_data, 0, fs.block_size);
+        else if (data_readv(&block, &data, 1, who) != 0)
+            return -1;
+        memcpy(block_data + off, buf, len);
+        return data_writev(&block, &data, 1) == 1 ? 0 : -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int slot = cache_get(block, !fresh, who);
+    if (slot != -1)
+    {
+        if (fresh)
+            memset(cache[slot].data, 0, fs.block_size);
+        memcpy(cache[slot].data + off, buf, len);
+        cache[slot].fresh |= fresh;
+        cache[slot].dirty = 1;
+        cache[slot].file = file;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return slot == -1 ? -1 : 0;
+}
+
+/*On a dedup disk, gives the FAT entry block a data block of its own before it is modified in the
+cache, so that writing it back later never needs a free block. The block is loaded first, from
+the data block it may share; a block that cannot be loaded is left to cache_modify to report.
+Returns -1 if the block is shared and no data block is free.*/
+static int cache_own(int block, int file, const char *who)
+{
+    if (fs.pmap_len == 0 || cache == NULL)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    int slot = cache_get(block, 1, who), ret = 0;
+    if (slot != -1)
+    {
+        int entry = block - fs.data_idx;
+        pthread_mutex_lock(&dedup_lock);
+        int p = PMAP[entry], copy;
+        if (REFS[p] == 1 && !held(p))
+            fp_remove(p); // found by no one until the cached copy is written back
+        else if ((copy = phys_alloc(entry)) != -1)
+        {
+            phys_put(p);
+            pmap_set(entry, copy);
+            cache[slot].dirty = cache[slot].fresh = 1; // copy holds nothing yet
+            cache[slot].file = file;
+        }
+        else
+            ret = -1;
+        pthread_mutex_unlock(&dedup_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static void cache_forget(int block)
+{
+    int slot = cache_lookup(block);
+    if (slot == -1)
+        return;
+    hash_remove(slot);
+    cache[slot].block = -1;
+    cache[slot].dirty = 0;
+    cache[slot].fresh = 0;
+    lru_unlink(slot);
+    cache[slot].prev = lru_tail;
+    cache[slot].next = -1;
+    if (lru_tail != -1)
+        cache[lru_tail].next = slot;
+    lru_tail = slot;
+    if (lru_head == -1)
+        lru_head = slot;
+}
+
+/*Forgets the cached copy of block, dirty or not, because the block is about to be overwritten
+on disk. The slot becomes the first candidate for reuse.*/
+static void cache_drop(int block)
+{
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    cache_forget(block);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*Copies len bytes at off within block out of the cache. Returns -1 if the block is not cached.*/
+static int cache_peek(int block, char *buf, size_t off, size_t len, const char *who)
+{
+    if (cache == NULL)
+        return -1;
+    pthread_mutex_lock(&cache_lock);
+    int slot = cache_check(cache_lookup(block), who);
+    if (slot != -1)
+    {
+        lru_unlink(slot);
+        lru_push(slot);
+        memcpy(buf, cache[slot].data + off, len);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return slot == -1 ? -1 : 0;
+}
+
+static int cache_lookup_block(int block)
+{
+    if (cache == NULL)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    int found = cache_find(block) != -1; // in flight counts as cached
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/*Enters a block that was just read from disk into the cache as a clean slot.*/
+static void cache_insert(int block, char *buf, const char *who)
+{
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    int slot = cache_get(block, 0, who);
+    if (slot != -1 && !cache[slot].dirty)
+        memcpy(cache[slot].data, buf, fs.block_size);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int cmp_slot_block(const void *a, const void *b)
+{
+    return cache[*(const int *)a].block - cache[*(const int *)b].block;
+}
+
+/*Writes the dirty blocks of file (every file if file is -1) back to the disk, in block order so
+that runs of adjacent blocks go out as single vectored writes. Fresh blocks of every file go too:
+they are already linked to their files, and committed before they are written they would show
+whatever the disk held there before.*/
+static int cache_flush(int file)
+{
+    int i, n = 0;
+    if (cache == NULL)
+        return 0;
+    int *slots = (int *)malloc(cache_size * sizeof(int));
+    if (slots == NULL)
+        return -1;
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < cache_size; i++)
+        if (cache[i].block != -1 && cache[i].dirty &&
+            (file == -1 || cache[i].file == file || cache[i].fresh))
+            slots[n++] = i;
+    qsort(slots, n, sizeof(int), cmp_slot_block);
+
+    int blocks[IO_BATCH];
+    char *bufs[IO_BATCH];
+    int start;
+    for (start = 0; start < n; start += IO_BATCH)
+    {
+        int count = n - start < IO_BATCH ? n - start : IO_BATCH;
+        for (i = 0; i < count; i++)
+        {
+            blocks[i] = cache[slots[start + i]].block;
+            bufs[i] = cache[slots[start + i]].data;
+        }
+        int done = data_writev(blocks, bufs, count);
+        for (i = 0; i < done; i++)
+            cache[slots[start + i]].dirty = cache[slots[start + i]].fresh = 0;
+        if (done != count)
+        {
+            fprintf(stderr, "fs_flush: Failed to write blocks to disk.\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(slots);
+    return start < n ? -1 : 0;
+}
+
+static void fat_set(int block, int next)
+{
+    FAT[block] = next;
+    fat_dirty[block / (fs.block_size / sizeof(int))] = 1;
+}
+
+static void lidx_set(int block, int idx)
+{
+    LIDX[block] = idx;
+    lidx_dirty[block / (fs.block_size / sizeof(int))] = 1;
+}
+
+/*Returns the largest size a file can grow to. Offsets and lengths beyond it are rejected.*/
+static off_t max_file_size(void)
+{
+    return (off_t)MAX_FILE_BLOCKS * fs.block_size;
+}
+
+static int block_index(int block)
+{
+    return LIDX[block] & ~(LIDX_UNWRITTEN | LIDX_COMP);
+}
+
+static int block_unwritten(int block)
+{
+    return LIDX[block] & LIDX_UNWRITTEN;
+}
+
+static int block_compressed(int block)
+{
+    return LIDX[block] & LIDX_COMP;
+}
+
+static void dir_touch(int slot)
+{
+    if (!dir_dirty[slot / DIR_PER_BLOCK])
+        dir_dirty_cnt++;
+    dir_dirty[slot / DIR_PER_BLOCK] = 1;
+}
+
+static int block_used(int block)
+{
+    return used_map[block / 8] & (1 << (block % 8));
+}
+
+static void take_block(int block)
+{
+    used_map[block / 8] |= 1 << (block % 8);
+    free_blocks--;
+    if (fs.pmap_len == 0)
+        mark_taken(block);
+}
+
+/*Returns 1 if n more blocks can be taken without touching the blocks set aside for buffered
+writes. On a dedup disk these are FAT entries, and phys_alloc does the same for data blocks.
+Called with meta_lock held.*/
+static int room_for(int n)
+{
+    return free_blocks - dalloc_resv >= n;
+}
+
+/*Allocates a free data block and marks it as the end of a chain. The search resumes where the
+previous one stopped and skips full bytes of the bitmap, so allocation is O(1) amortized.
+Returns -1 when the disk is full.*/
+static int alloc_block(void)
+{
+    int nbytes = (NODES + 7) / 8;
+    int n;
+    if (!room_for(1))
+        return -1;
+    for (n = 0; n < nbytes; n++)
+    {
+        int byte = (alloc_hint + n) % nbytes;
+        if (used_map[byte] == 0xff)
+            continue;
+        int bit;
+        for (bit = 0; bit < 8; bit++)
+        {
+            int block = byte * 8 + bit;
+            if (block < NODES && !block_used(block))
+            {
+                take_block(block);
+                alloc_hint = byte;
+                fat_set(block, -1);
+                return block;
+            }
+        }
+    }
+    return -1;
+}
+
+/*Frees a FAT entry. Its data block waits for the next commit if a committed file may hold it.*/
+static void free_block(int block)
+{
+    if (fs.pmap_len > 0 || !hold_freed(block))
+    {
+        used_map[block / 8] &= ~(1 << (block % 8));
+        free_blocks++;
+    }
+    else
+        freed_cnt++;
+    fat_set(block, 0);
+    if (fs.pmap_len == 0)
+        return;
+    cache_drop(fs.data_idx + block); // a dirty copy must not reach a data block given up
+    pthread_mutex_lock(&dedup_lock);
+    if (PMAP[block] != -1) // entries reserved under FS_ALLOC_EXTENT have none yet
+        phys_put(PMAP[block]);
+    pmap_set(block, -1);
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+/*Finds a run of len free blocks, starting the search where the previous run ended (next-fit).
+Returns the first block of the run, or -1 if there is no such run.*/
+static int find_free_run(int len)
+{
+    int start = -1, count = 0;
+    int n;
+    for (n = 0; n < NODES; n++)
+    {
+        int block = (extent_hint + n) % NODES;
+        if (block == 0)
+            count = 0; // runs do not wrap around the end of the disk
+        if (count == 0 && block % 8 == 0 && block + 8 <= NODES && used_map[block / 8] == 0xff)
+        {
+            n += 7; // skip a full byte of the bitmap
+            continue;
+        }
+        if (block_used(block))
+        {
+            count = 0;
+            continue;
+        }
+        if (count++ == 0)
+            start = block;
+        if (count == len)
+        {
+            extent_hint = (start + len) % NODES;
+            return start;
+        }
+    }
+    return -1;
+}
+
+static void release_resv(int filenum)
+{
+    while (resv[filenum].next < resv[filenum].end)
+        free_block(resv[filenum].next++);
+    resv[filenum].next = resv[filenum].end = 0;
+}
+
+/*Allocates the next block for file filenum according to the allocation policy. Under
+FS_ALLOC_EXTENT the block right after the tail is taken when it is free, then the file's
+reservation is used, and a new run of extent_blocks is reserved when that is exhausted. If no
+such run is left, allocation falls back to any free block.*/
+static int alloc_chain_block(int filenum)
+{
+    if (fs.alloc_policy != FS_ALLOC_EXTENT)
+        return alloc_block();
+
+    int goal = tail_block[filenum] + 1;
+    struct extent_resv *r = &resv[filenum];
+    if (tail_block[filenum] != -1 && goal < NODES && !block_used(goal) && room_for(1))
+    {
+        take_block(goal);
+        fat_set(goal, -1);
+        return goal;
+    }
+    if (r->next < r->end)
+    {
+        fat_set(r->next, -1);
+        return r->next++;
+    }
+
+    int start = room_for(fs.extent_blocks) ? find_free_run(fs.extent_blocks) : -1;
+    if (start == -1)
+        return alloc_block();
+    int i;
+    for (i = start; i < start + fs.extent_blocks; i++)
+        take_block(i);
+    r->next = start + 1;
+    r->end = start + fs.extent_blocks;
+    fat_set(start, -1);
+    return start;
+}
+
+/*alloc_chain_block, and on a dedup disk a data block for the new FAT entry as well. Returns -1
+if either runs out.*/
+static int alloc_file_block(int filenum)
+{
+    int block = alloc_chain_block(filenum);
+    if (block != -1 && fs.pmap_len > 0 && phys_attach(block) != 0)
+    {
+        free_block(block);
+        return -1;
+    }
+    return block;
+}
+
+/*Counts the entries mapped to each data block of a dedup disk and enters the blocks of files in
+the fingerprint index. Entries that are not in use are left without a data block.*/
+static int build_dedup_state(void)
+{
+    int i;
+    REFS = (int *)calloc(DATA_BLOCKS, sizeof(int));
+    fp_buckets = DATA_BLOCKS / 2 + 1;
+    fp_head = (int *)malloc(fp_buckets * sizeof(int));
+    fp_next = (int *)malloc(DATA_BLOCKS * sizeof(int));
+    if (REFS == NULL || fp_head == NULL || fp_next == NULL)
+        return -1;
+    for (i = 0; i < fp_buckets; i++)
+        fp_head[i] = -1;
+    for (i = 0; i < DATA_BLOCKS; i++)
+        fp_next[i] = -2;
+    for (i = 0; i < fs.dir_len; i++)
+        REFS[PMAP[dir_blocks[i]]]++;
+    for (i = 0; i < fs.dir_cap; i++)
+    {
+        int block;
+        for (block = DIR[i].used ? DIR[i].head : -1; block != -1; block = FAT[block])
+        {
+            int p = PMAP[block];
+            if (REFS[p]++ == 0)
+                fp_insert(p);
+        }
+    }
+    phys_free = 0;
+    phys_hint = 0;
+    for (i = 0; i < DATA_BLOCKS; i++)
+        if (REFS[i] == 0)
+            phys_free++;
+    for (i = 0; i < NODES; i++)
+        if (!block_used(i))
+            PMAP[i] = -1;
+    return 0;
+}
+
+/*Builds the free-space bitmap and the tail cache by walking the chain of every file.*/
+static int build_alloc_state(void)
+{
+    used_map = (unsigned char *)calloc((NODES + 7) / 8, 1);
+    freed_map = (unsigned char *)calloc((DATA_BLOCKS + 7) / 8, 1);
+    taken_map = (unsigned char *)calloc((DATA_BLOCKS + 7) / 8, 1);
+    freed_cnt = 0;
+    tail_block = (int *)malloc(fs.dir_cap * sizeof(int));
+    resv = (struct extent_resv *)calloc(fs.dir_cap, sizeof(struct extent_resv));
+    dalloc = (struct delalloc *)calloc(fs.dir_cap, sizeof(struct delalloc));
+    dalloc_cnt = 0;
+    dalloc_resv = 0;
+    if (used_map == NULL || freed_map == NULL || taken_map == NULL || tail_block == NULL ||
+        resv == NULL || dalloc == NULL)
+    {
+        free(used_map);
+        free(freed_map);
+        free(taken_map);
+        freed_map = taken_map = NULL;
+        free(tail_block);
+        free(resv);
+        free(dalloc);
+        dalloc = NULL;
+        used_map = NULL;
+        tail_block = NULL;
+        resv = NULL;
+        return -1;
+    }
+    alloc_hint = 0;
+    extent_hint = 0;
+
+    int i;
+    for (i = 0; i < fs.dir_len; i++)
+        used_map[dir_blocks[i] / 8] |= 1 << (dir_blocks[i] % 8);
+    for (i = 0; i < fs.dir_cap; i++)
+    {
+        tail_block[i] = -1;
+        if (!DIR[i].used)
+            continue;
+        int block = DIR[i].head, pos = 0;
+        while (block != -1)
+        {
+            used_map[block / 8] |= 1 << (block % 8);
+            if (fs.lidx_len == 0) // files on such a disk are dense
+                LIDX[block] = pos++;
+            tail_block[i] = block;
+            block = FAT[block];
+        }
+    }
+    free_blocks = 0;
+    for (i = 0; i < NODES; i++)
+        if (!block_used(i))
+            free_blocks++;
+    return fs.pmap_len > 0 ? build_dedup_state() : 0;
+}
+
+static unsigned int name_hash(const char *name)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int dir_lookup(const char *name)
+{
+    int slot = dir_hash[name_hash(name) % dir_buckets];
+    while (slot != -1 && strcmp(DIR[slot].name, name) != 0)
+        slot = dir_hnext[slot];
+    return slot;
+}
+
+static void dir_index_add(int slot)
+{
+    unsigned int b = name_hash(DIR[slot].name) % dir_buckets;
+    dir_hnext[slot] = dir_hash[b];
+    dir_hash[b] = slot;
+}
+
+static void dir_index_remove(int slot)
+{
+    int *link = &dir_hash[name_hash(DIR[slot].name) % dir_buckets];
+    while (*link != slot)
+        link = &dir_hnext[*link];
+    *link = dir_hnext[slot];
+}
+
+static void free_dir_index(void)
+{
+    free(dir_hash);
+    free(dir_hnext);
+    free(free_slots);
+    dir_hash = dir_hnext = free_slots = NULL;
+    dir_buckets = 1;
+}
+
+/*(Re)builds the name hash table with room for the current directory capacity.*/
+static int rehash_dir(void)
+{
+    int i;
+    int *table = (int *)malloc((fs.dir_cap * 2 + 1) * sizeof(int));
+    if (table == NULL)
+        return -1;
+    free(dir_hash);
+    dir_hash = table;
+    dir_buckets = fs.dir_cap * 2 + 1;
+    for (i = 0; i < dir_buckets; i++)
+        dir_hash[i] = -1;
+    for (i = 0; i < fs.dir_cap; i++)
+        if (DIR[i].used)
+            dir_index_add(i);
+    return 0;
+}
+
+/*Builds the name index and the free-slot stack from DIR. Open counts left on disk by a crash
+are cleared, since no descriptors survive a mount.*/
+static int build_dir_index(void)
+{
+    int i;
+    dir_hnext = (int *)malloc(fs.dir_cap * sizeof(int));
+    free_slots = (int *)malloc(fs.dir_cap * sizeof(int));
+    if (dir_hnext == NULL || free_slots == NULL || rehash_dir() != 0)
+    {
+        free_dir_index();
+        return -1;
+    }
+    nfree_slots = 0;
+    for (i = fs.dir_cap - 1; i >= 0; i--) // lowest slots are handed out first
+    {
+        DIR[i].ref_cnt = 0;
+        if (!DIR[i].used)
+            free_slots[nfree_slots++] = i;
+    }
+    return 0;
+}
+
+/*Loads the directory chain into DIR, one vectored request per batch.*/
+static int dir_load(void)
+{
+    int blocks[IO_BATCH];
+    char *bufs[IO_BATCH];
+    int i, n = 0;
+    for (i = 0; i < fs.dir_len; i++)
+    {
+        blocks[n] = data_block(fs.data_idx + dir_blocks[i]);
+        bufs[n] = (char *)DIR + (size_t)i * fs.block_size;
+        if (++n == IO_BATCH || i == fs.dir_len - 1)
+        {
+            if (block_readv(blocks, bufs, n) != 0)
+                return -1;
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+/*Collects the dirty FAT, LIDX, PMAP and directory blocks, and the super block if it changed,
+into blocks and bufs. super must hold one block. Returns the number of blocks.*/
+static int gather_dirty(int *blocks, char **bufs, char *super)
+{
+    int i, n = 0;
+    for (i = 0; i < fs.fat_len; i++)
+    {
+        if (fat_dirty[i])
+        {
+            blocks[n] = fs.fat_idx + i;
+            bufs[n++] = (char *)FAT + (size_t)i * fs.block_size;
+        }
+    }
+    for (i = 0; i < fs.lidx_len; i++)
+    {
+        if (lidx_dirty[i])
+        {
+            blocks[n] = fs.lidx_idx + i;
+            bufs[n++] = (char *)LIDX + (size_t)i * fs.block_size;
+        }
+    }
+    for (i = 0; i < fs.pmap_len; i++)
+    {
+        if (pmap_dirty[i])
+        {
+            blocks[n] = fs.pmap_idx + i;
+            bufs[n++] = (char *)PMAP + (size_t)i * fs.block_size;
+        }
+    }
+    for (i = 0; i < fs.dir_len; i++)
+    {
+        if (dir_dirty[i])
+        {
+            blocks[n] = data_block(fs.data_idx + dir_blocks[i]);
+            bufs[n++] = (char *)DIR + (size_t)i * fs.block_size;
+        }
+    }
+    if (super_dirty)
+    {
+        memset(super, '\0', fs.block_size);
+        memcpy(super, &fs, sizeof(struct super_block));
+        blocks[n] = 0;
+        bufs[n++] = super;
+    }
+    return n;
+}
+
+static int write_in_place(int *blocks, char **bufs, int n)
+{
+    int i;
+    for (i = 0; i < n; i += IO_BATCH)
+        if (block_writev(blocks + i, bufs + i, n - i < IO_BATCH ? n - i : IO_BATCH) != 0)
+            return -1;
+    return 0;
+}
+
+static int jnl_write_header(int seq)
+{
+    char block[fs.block_size];
+    struct jnl_header *h = (struct jnl_header *)block;
+    memset(block, 0, fs.block_size);
+    h->magic = JNL_MAGIC;
+    h->seq = seq;
+    return block_write(fs.jnl_idx, block);
+}
+
+/*Blocks taken by the descriptor of a transaction of n images.*/
+static int jnl_desc_blocks(int n)
+{
+    return (sizeof(struct jnl_desc) + (size_t)n * sizeof(int) + fs.block_size - 1) / fs.block_size;
+}
+
+/*Most images one transaction can carry in a journal of len blocks, next to the header and the
+descriptor.*/
+static int jnl_max_tx(int len)
+{
+    int n = len - 2;
+    while (n > 0 && 1 + jnl_desc_blocks(n) + n > len)
+        n--;
+    return n > 0 ? n : 0;
+}
+
+/*Most images of one transaction, which takes at most JNL_TX_BYTES with its descriptor.*/
+static int jnl_tx_images(void)
+{
+    int len = JNL_TX_BYTES / fs.block_size;
+    return jnl_max_tx(len > 3 ? len + 1 : 4);
+}
+
+/*Blocks of the largest transaction, the size of jnl_tx.*/
+static int jnl_tx_blocks(void)
+{
+    return jnl_desc_blocks(jnl_tx_images()) + jnl_tx_images();
+}
+
+/*Journal blocks taken by a commit of n images.*/
+static long long jnl_commit_blocks(int n)
+{
+    int c = jnl_tx_images(), rest = n % c;
+    return (long long)(n / c) * jnl_tx_blocks() + (rest > 0 ? jnl_desc_blocks(rest) + rest : 0);
+}
+
+/*Most images one commit can carry in a journal of len blocks, next to the header.*/
+static int jnl_max_commit(int len)
+{
+    int full = (len - 1) / jnl_tx_blocks();
+    return full * jnl_tx_images() + jnl_max_tx(len - full * jnl_tx_blocks());
+}
+
+/*Writes the images committed since the last checkpoint to their home blocks and empties the
+journal. They are read back from the journal a transaction's worth at a time, in order, so the
+newest image of a block wins.*/
+static int jnl_checkpoint(void)
+{
+    int per = jnl_tx_blocks();
+    int blocks[per];
+    char *bufs[per];
+    int start, i;
+    if (jnl_head <= 1)
+        return 0;
+    for (start = 1; start < jnl_head; start += per)
+    {
+        int len = jnl_head - start < per ? jnl_head - start : per, n = 0;
+        if (block_read_range(fs.jnl_idx + start, len, jnl_tx) != 0)
+            return -1;
+        for (i = 0; i < len; i++)
+        {
+            if (jnl_home[start + i] == -1)
+                continue;
+            blocks[n] = jnl_home[start + i];
+            bufs[n++] = jnl_tx + (size_t)i * fs.block_size;
+        }
+        if (write_in_place(blocks, bufs, n) != 0)
+            return -1;
+    }
+    if (disk_sync() != 0 || jnl_write_header(jnl_seq) != 0 || disk_sync() != 0)
+        return -1;
+    jnl_head = 1;
+    return 0;
+}
+
+/*Commits n metadata blocks: the images go to the journal as transactions of up to
+jnl_tx_images, staged one at a time in jnl_tx, followed by a single disk sync. The journal has
+room for n (jnl_max_commit). A failed commit leaves its transactions to be overwritten.*/
+static int jnl_commit(int *blocks, char **bufs, int n)
+{
+    if (jnl_head + jnl_commit_blocks(n) > fs.jnl_len && jnl_checkpoint() != 0)
+        return -1;
+
+    int head = jnl_head, seq = jnl_seq;
+    int start, i;
+    for (start = 0; start < n; start += jnl_tx_images())
+    {
+        int k = n - start < jnl_tx_images() ? n - start : jnl_tx_images();
+        int d = jnl_desc_blocks(k);
+        struct jnl_desc *desc = (struct jnl_desc *)jnl_tx;
+        memset(jnl_tx, 0, (size_t)d * fs.block_size);
+        desc->magic = TX_MAGIC;
+        desc->seq = jnl_seq;
+        desc->count = k;
+        desc->more = start + k < n;
+        for (i = 0; i < d; i++)
+            jnl_home[jnl_head + i] = -1;
+        for (i = 0; i < k; i++)
+        {
+            desc->target[i] = blocks[start + i];
+            memcpy(jnl_tx + (size_t)(d + i) * fs.block_size, bufs[start + i], fs.block_size);
+            jnl_home[jnl_head + d + i] = blocks[start + i];
+        }
+        desc->crc = crc32c(0, jnl_tx, (size_t)(d + k) * fs.block_size);
+        if (block_write_range(fs.jnl_idx + jnl_head, d + k, jnl_tx) != 0)
+            break;
+        jnl_head += d + k;
+        jnl_seq++;
+    }
+    if (start < n || disk_sync() != 0)
+    {
+        jnl_head = head;
+        jnl_seq = seq;
+        fprintf(stderr, "fs_sync: Failed to commit the journal.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*Directory blocks one commit can carry next to every table block and the super block. If the
+whole directory does not fit, the directory grows only while there is room for the blocks the
+open files and one namespace operation can dirty (dir_grow), and namespace operations commit
+first when those might not fit any more (dir_make_room).*/
+static int jnl_room(void)
+{
+    return jnl_max_commit(fs.jnl_len) - (fs.fat_len + fs.lidx_len + fs.pmap_len + 1);
+}
+
+/*Hands the blocks held since the last commit back to the allocator, now that the metadata that
+no longer uses them is committed, and starts over with nothing taken. Called with ns_lock held
+exclusively.*/
+static void release_freed(void)
+{
+    int b, nbytes = (DATA_BLOCKS + 7) / 8;
+    for (b = 0; freed_cnt > 0 && b < DATA_BLOCKS; b++)
+    {
+        if (freed_map[b / 8] == 0)
+        {
+            b |= 7; // skip a clear byte
+            continue;
+        }
+        if (!held(b))
+            continue;
+        if (fs.pmap_len > 0)
+        {
+            if (REFS[b] > 0)
+                continue; // lost a reference, but is still in use
+            phys_free++;
+        }
+        else
+        {
+            used_map[b / 8] &= ~(1 << (b % 8));
+            free_blocks++;
+        }
+        freed_cnt--;
+    }
+    memset(freed_map, 0, nbytes);
+    memset(taken_map, 0, nbytes);
+}
+
+/*Writes the dirty metadata. With a journal, all of it is committed at once (group commit) and
+reaches its home blocks later, at a checkpoint.*/
+static int sync_meta(void)
+{
+    char super[fs.block_size];
+    int max = fs.fat_len + fs.lidx_len + fs.pmap_len + fs.dir_len + 1;
+    int *blocks = (int *)malloc(max * sizeof(int));
+    char **bufs = (char **)malloc(max * sizeof(char *));
+    int n, ret = -1;
+    if (blocks == NULL || bufs == NULL)
+        goto out;
+
+    n = gather_dirty(blocks, bufs, super);
+    if (n == 0)
+        ret = 0;
+    else if (fs.jnl_len == 0)
+        ret = write_in_place(blocks, bufs, n);
+    else if (n <= jnl_max_commit(fs.jnl_len)) // always, as long as jnl_room holds
+        ret = jnl_commit(blocks, bufs, n);
+    if (ret != 0)
+    {
+        fprintf(stderr, "fs_sync: Failed to write metadata to disk.\n");
+        goto out;
+    }
+
+    memset(fat_dirty, 0, fs.fat_len);
+    memset(lidx_dirty, 0, fs.fat_len);
+    if (fs.pmap_len > 0)
+        memset(pmap_dirty, 0, fs.pmap_len);
+    memset(dir_dirty, 0, fs.dir_len);
+    dir_dirty_cnt = 0;
+    super_dirty = 0;
+    release_freed();
+out:
+    free(blocks);
+    free(bufs);
+    return ret;
+}
+
+/*Reads the transaction at pos of the journal into buf, which holds jnl_tx_blocks, and checks it.
+Returns its number of images, or -1 if no intact transaction numbered seq starts there.*/
+static int jnl_read_tx(int pos, int seq, char *buf)
+{
+    struct jnl_desc *desc = (struct jnl_desc *)buf;
+    if (pos + 1 >= fs.jnl_len || block_read(fs.jnl_idx + pos, buf) != 0)
+        return -1;
+    if (desc->magic != TX_MAGIC || desc->seq != seq || desc->count < 1 ||
+        desc->count > jnl_tx_images())
+        return -1;
+    int n = desc->count, d = jnl_desc_blocks(n);
+    if (pos + d + n > fs.jnl_len ||
+        block_read_range(fs.jnl_idx + pos + 1, d - 1 + n, buf + fs.block_size) != 0)
+        return -1;
+    unsigned int crc = desc->crc;
+    desc->crc = 0;
+    if (crc32c(0, buf, (size_t)(d + n) * fs.block_size) != crc)
+        return -1; // torn transaction, never committed
+    return n;
+}
+
+/*Replays the commits left in the journal by a crash, writing their images to their home blocks,
+then empties the journal. A first pass finds where the last whole commit ends, so that a commit
+cut short by the crash is left out. Runs before any metadata is loaded.*/
+static int jnl_replay(void)
+{
+    char *block = (char *)malloc((size_t)jnl_tx_blocks() * fs.block_size);
+    if (block == NULL)
+        return -1;
+    if (block_read(fs.jnl_idx, block) != 0)
+    {
+        free(block);
+        return -1;
+    }
+
+    struct jnl_header *h = (struct jnl_header *)block;
+    struct jnl_desc *desc = (struct jnl_desc *)block;
+    int first = h->magic == JNL_MAGIC ? h->seq : 1;
+    int pos = 1, seq = first, end = 1, end_seq = first, n;
+    while ((n = jnl_read_tx(pos, seq, block)) != -1)
+    {
+        pos += jnl_desc_blocks(n) + n;
+        seq++;
+        if (!desc->more)
+        {
+            end = pos;
+            end_seq = seq;
+        }
+    }
+
+    for (pos = 1, seq = first; pos < end; seq++)
+    {
+        int i, d;
+        if ((n = jnl_read_tx(pos, seq, block)) == -1)
+            break;
+        d = jnl_desc_blocks(n);
+        for (i = 0; i < n; i++)
+            if (block_write(desc->target[i], block + (size_t)(d + i) * fs.block_size) != 0)
+                break;
+        if (i < n)
+            break;
+        pos += d + n;
+    }
+    free(block);
+    if (pos < end)
+        return -1;
+
+    jnl_seq = end_seq;
+    jnl_head = 1;
+    if (end > 1 && (disk_sync() != 0 || jnl_write_header(end_seq) != 0 || disk_sync() != 0))
+        return -1;
+    return 0;
+}
+
+static int grow_array(void **array, size_t size)
+{
+    void *p = realloc(*array, size);
+    if (p == NULL)
+        return -1;
+    *array = p;
+    return 0;
+}
+
+/*Destroys the file locks and frees their array.*/
+static void file_locks_free(void)
+{
+    int i;
+    for (i = 0; i < file_lock_cnt; i++)
+        pthread_rwlock_destroy(&file_lock[i]);
+    free(file_lock);
+    file_lock = NULL;
+    file_lock_cnt = 0;
+}
+
+/*Replaces the file locks with cap new ones. Only called while no file lock can be held, at
+mount_fs and with ns_lock held exclusively.*/
+static int file_locks_init(int cap)
+{
+    int i;
+    pthread_rwlock_t *locks = (pthread_rwlock_t *)malloc(cap * sizeof(pthread_rwlock_t));
+    if (locks == NULL)
+        return -1;
+    for (i = 0; i < cap; i++)
+        pthread_rwlock_init(&locks[i], NULL);
+    file_locks_free();
+    file_lock = locks;
+    file_lock_cnt = cap;
+    return 0;
+}
+
+/*Adds one block of free entries to the end of the directory. Returns -1 if the disk is full, or
+if the journal has no room for a larger directory (jnl_room).*/
+static int dir_grow(void)
+{
+    if (fs.jnl_len > 0 && fs.dir_len + 1 > jnl_room() && jnl_room() < MAX_FD + 2)
+        return -1;
+    int block = alloc_block();
+    if (block == -1)
+        return -1;
+    if (fs.pmap_len > 0 && phys_attach(block) != 0)
+    {
+        free_block(block);
+        return -1;
+    }
+
+    int cap = fs.dir_cap + DIR_PER_BLOCK;
+    if (grow_array((void **)&DIR, (size_t)cap * sizeof(struct dir_entry)) != 0 ||
+        grow_array((void **)&dir_blocks, (fs.dir_len + 1) * sizeof(int)) != 0 ||
+        grow_array((void **)&tail_block, cap * sizeof(int)) != 0 ||
+        grow_array((void **)&resv, cap * sizeof(struct extent_resv)) != 0 ||
+        grow_array((void **)&dalloc, cap * sizeof(struct delalloc)) != 0 ||
+        grow_array((void **)&dir_hnext, cap * sizeof(int)) != 0 ||
+        grow_array((void **)&free_slots, cap * sizeof(int)) != 0 ||
+        grow_array((void **)&dir_dirty, fs.dir_len + 1) != 0 ||
+        file_locks_init(cap) != 0)
+    {
+        free_block(block); // arrays that did grow are simply larger than needed
+        return -1;
+    }
+
+    memset(DIR + fs.dir_cap, 0, DIR_PER_BLOCK * sizeof(struct dir_entry));
+    memset(resv + fs.dir_cap, 0, DIR_PER_BLOCK * sizeof(struct extent_resv));
+    memset(dalloc + fs.dir_cap, 0, DIR_PER_BLOCK * sizeof(struct delalloc));
+    int i;
+    for (i = cap - 1; i >= fs.dir_cap; i--)
+    {
+        tail_block[i] = -1;
+        free_slots[nfree_slots++] = i;
+    }
+    fat_set(dir_blocks[fs.dir_len - 1], block);
+    lidx_set(block, fs.dir_len);
+    dir_dirty[fs.dir_len] = 1;
+    dir_dirty_cnt++;
+    dir_blocks[fs.dir_len++] = block;
+    fs.dir_cap = cap;
+    super_dirty = 1;
+
+    if (rehash_dir() != 0) // keep the load factor at or below 1/2
+        return -1;
+    return 0;
+}
+
+/*Starts asynchronous reads of the listed blocks into cache slots and returns without waiting;
+a slot is settled when it is next looked up or recycled. Blocks already cached are skipped.*/
+static void cache_prefetch(int *blocks, int n)
+{
+    struct block_req *reqs[IO_BATCH];
+    int i, j = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < n; i++)
+    {
+        if (cache_find(blocks[i]) != -1)
+            continue; // another reader got there first
+        int slot = cache_get(blocks[i], 0, "fs_read");
+        if (slot == -1)
+            break;
+        struct block_req *req = &cache[slot].req;
+        req->block = data_block(blocks[i]);
+        req->count = 1;
+        req->buf = cache[slot].data;
+        req->write = 0;
+        req->data = (void *)(size_t)slot;
+        cache[slot].busy = 1;
+        reqs[j++] = req;
+    }
+    if (j > 0 && block_submit(reqs, j) != 0)
+        for (i = 0; i < j; i++)
+        {
+            int slot = (int)(size_t)reqs[i]->data;
+            cache[slot].busy = 0;
+            cache_forget(cache[slot].block);
+        }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*Returns the block holding logical block idx of the file behind fd, or -1 if idx lies in a hole
+or past the last block. The FAT is walked forward from the descriptor's cursor when it lies at
+or before idx, and from the head of the file otherwise, so sequential access costs one step per
+block. The cursor is left on the last block at or before idx, after which a block for idx would
+be linked in; it is -1 if there is no such block.*/
+static int fd_block(struct file_descriptor *fd, int idx)
+{
+    int block = DIR[fd->file].head;
+    int prev = -1;
+    if (fd->cur_block != -1 && fd->cur_idx <= idx)
+        block = fd->cur_block;
+
+    while (block != -1 && block_index(block) < idx)
+    {
+        prev = block;
+        block = FAT[block];
+    }
+    if (block != -1 && block_index(block) == idx)
+        prev = block;
+    fd->cur_block = prev;
+    fd->cur_idx = prev == -1 ? 0 : block_index(prev);
+    return prev != -1 && block_index(prev) == idx ? prev : -1;
+}
+
+/*Links block into the chain of the file behind fd as its logical block idx, after the block
+fd_block left the cursor on, and moves the cursor onto it. Called with meta_lock held.*/
+static void link_block(struct file_descriptor *fd, int block, int idx)
+{
+    struct dir_entry *file = &DIR[fd->file];
+    int prev = fd->cur_block;
+    if (prev == -1)
+    {
+        fat_set(block, file->head);
+        file->head = block;
+        dir_touch(fd->file);
+    }
+    else
+    {
+        fat_set(block, FAT[prev]);
+        fat_set(prev, block);
+    }
+    if (FAT[block] == -1)
+        tail_block[fd->file] = block;
+    fd->cur_block = block;
+    fd->cur_idx = idx;
+}
+
+/*Hands back the blocks set aside for the buffer of file filenum. Called with meta_lock held.*/
+static void dalloc_unreserve(int filenum)
+{
+    pthread_mutex_lock(&dedup_lock);
+    dalloc_resv -= dalloc[filenum].resv;
+    pthread_mutex_unlock(&dedup_lock);
+    dalloc[filenum].resv = 0;
+}
+
+static void dalloc_drop(int filenum)
+{
+    if (dalloc[filenum].data == NULL)
+        return;
+    free(dalloc[filenum].data);
+    dalloc[filenum].data = NULL;
+    pthread_mutex_lock(&meta_lock);
+    dalloc_unreserve(filenum);
+    dalloc_cnt--;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/*Reads the n data blocks in blocks into bufs, from the cache where possible and otherwise as one
+vectored request, whose blocks are then cached. n is at most MAX_CLUSTER.*/
+static int cached_readv(const int *blocks, char **bufs, int n, const char *who)
+{
+    int miss[MAX_CLUSTER];
+    char *mbufs[MAX_CLUSTER];
+    int i, m = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (cache_peek(fs.data_idx + blocks[i], bufs[i], 0, fs.block_size, who) != 0)
+        {
+            miss[m] = fs.data_idx + blocks[i];
+            mbufs[m++] = bufs[i];
+        }
+    }
+    if (m > 0 && data_readv(miss, mbufs, m, who) != 0)
+        return -1;
+    for (i = 0; i < m; i++)
+        cache_insert(miss[i], mbufs[i], who);
+    return 0;
+}
+
+/*Lists in blocks the blocks holding cluster c of the file behind cur and returns their number.
+The cursor is left on the last block before the cluster, after which its blocks are linked.*/
+static int cluster_blocks(struct file_descriptor *cur, int c, int *blocks)
+{
+    int first = c * fs.comp_cluster;
+    int tail = tail_block[cur->file];
+    int block;
+    if (tail != -1 && block_index(tail) < first) // appending, no need to walk the chain
+    {
+        cur->cur_block = tail;
+        cur->cur_idx = block_index(tail);
+        return 0;
+    }
+    fd_block(cur, first - 1);
+    block = cur->cur_block == -1 ? DIR[cur->file].head : FAT[cur->cur_block];
+    int n = 0;
+    while (block != -1 && block_index(block) < first + fs.comp_cluster)
+    {
+        blocks[n++] = block;
+        block = FAT[block];
+    }
+    return n;
+}
+
+/*Fills buf with cluster c of the file behind cur. A compressed cluster is expanded as a whole;
+of a raw one only the blocks from lo up to hi within the cluster are read. Errors are reported
+as who's.*/
+static int cluster_load(struct file_descriptor *cur, int c, char *buf, int lo, int hi,
+                        const char *who)
+{
+    int blocks[MAX_CLUSTER];
+    char *bufs[MAX_CLUSTER];
+    int n = cluster_blocks(cur, c, blocks);
+    int first = c * fs.comp_cluster;
+    size_t size = (size_t)fs.comp_cluster * fs.block_size;
+    int i, m = 0;
+
+    if (n > 0 && block_compressed(blocks[0]))
+    {
+        char *z = (char *)malloc((size_t)n * fs.block_size);
+        if (z == NULL)
+            return -1;
+        for (i = 0; i < n; i++)
+            bufs[i] = z + (size_t)i * fs.block_size;
+        int len = -1;
+        if (cached_readv(blocks, bufs, n, who) == 0)
+            memcpy(&len, z, sizeof(int));
+        if (len < 0 || len > n * fs.block_size - (int)sizeof(int) ||
+            lz_decompress(z + sizeof(int), len, buf, size) != (int)size)
+        {
+            free(z);
+            fprintf(stderr, "%s: Failed to read compressed cluster.\n", who);
+            return -1;
+        }
+        free(z);
+        return 0;
+    }
+
+    memset(buf + (size_t)lo * fs.block_size, 0, (size_t)(hi - lo) * fs.block_size);
+    for (i = 0; i < n; i++)
+    {
+        int idx = block_index(blocks[i]) - first;
+        if (idx >= lo && idx < hi && !block_unwritten(blocks[i]))
+        {
+            blocks[m] = blocks[i];
+            bufs[m++] = buf + (size_t)idx * fs.block_size;
+        }
+    }
+    if (cached_readv(blocks, bufs, m, who) != 0)
+    {
+        fprintf(stderr, "%s: Failed to read block from disk.\n", who);
+        return -1;
+    }
+    return 0;
+}
+
+/*Stores data as cluster c of file filenum in place of what the cluster held. The new contents
+go to newly allocated blocks and the old blocks are freed, so they stay as they were until the
+next commit and a crash leaves the committed cluster readable. Cursors on the old blocks, of open
+descriptors and of own, fall back to the head of the file. Every block the cluster needs is
+secured before the chain changes, so that running out of space leaves the cluster as it was,
+blocks set aside for a buffered cluster included.
+
+If shrink is set and there are not enough free blocks, the cluster is rewritten in the blocks it
+already has instead, so that a full disk cannot keep a file from shrinking. The committed
+metadata describes what those blocks held before, so a crash before the next commit may leave
+the cluster unreadable. Errors are reported as who's. Called with the file locked for writing,
+or ns_lock held exclusively.*/
+static int cluster_store(int filenum, int c, const char *data, int shrink,
+                         struct file_descriptor *own, const char *who)
+{
+    int first = c * fs.comp_cluster;
+    size_t size = (size_t)fs.comp_cluster * fs.block_size;
+    int old[MAX_CLUSTER], blocks[MAX_CLUSTER], idx[MAX_CLUSTER];
+    char *bufs[MAX_CLUSTER];
+    int i, n = 0;
+
+    // Raw, the cluster takes its non-zero blocks; compressed, it must take fewer
+    for (i = 0; i < fs.comp_cluster; i++)
+    {
+        const char *b = data + (size_t)i * fs.block_size;
+        if (b[0] != 0 || memcmp(b, b + 1, fs.block_size - 1) != 0)
+        {
+            bufs[n] = (char *)b;
+            idx[n++] = first + i;
+        }
+    }
+    char *z = NULL;
+    if (n > 1 && (z = (char *)calloc(n - 1, fs.block_size)) != NULL)
+    {
+        int len = lz_compress(data, size, z + sizeof(int), (n - 1) * fs.block_size - sizeof(int));
+        if (len != -1)
+        {
+            memcpy(z, &len, sizeof(int));
+            n = (len + sizeof(int) + fs.block_size - 1) / fs.block_size;
+            for (i = 0; i < n; i++)
+            {
+                bufs[i] = z + (size_t)i * fs.block_size;
+                idx[i] = (first + i) | LIDX_COMP;
+            }
+        }
+    }
+
+    struct file_descriptor cur;
+    cur.file = filenum;
+    cur.cur_block = -1;
+    cur.cur_idx = 0;
+    int nold = cluster_blocks(&cur, c, old);
+
+    pthread_mutex_lock(&meta_lock);
+    int held = data == dalloc[filenum].data ? dalloc[filenum].resv : 0;
+    if (held > 0)
+        dalloc_unreserve(filenum); // the blocks set aside for the buffer are taken now
+    int reuse = 0; // leading old blocks rewritten in place
+    for (;;) // take the blocks first, so a full disk changes nothing
+    {
+        for (i = reuse; i < n; i++)
+            if ((blocks[i] = alloc_file_block(filenum)) == -1)
+                break;
+        if (i == n && (reuse == 0 || fs.pmap_len == 0 || phys_own(old, reuse) == 0))
+            break;
+        while (--i >= reuse)
+            free_block(blocks[i]);
+        if (!shrink || reuse > 0 || nold == 0)
+        {
+            if (held > 0) // the buffer keeps its blocks
+            {
+                pthread_mutex_lock(&dedup_lock);
+                dalloc_resv += held;
+                pthread_mutex_unlock(&dedup_lock);
+                dalloc[filenum].resv = held;
+            }
+            pthread_mutex_unlock(&meta_lock);
+            free(z);
+            no_space(who);
+            return -1;
+        }
+        reuse = nold < n ? nold : n;
+    }
+    // Unlink the old blocks, then link the new ones in their place
+    int prev = cur.cur_block;
+    if (nold > 0)
+    {
+        int next = FAT[old[nold - 1]];
+        if (prev == -1)
+        {
+            DIR[filenum].head = next;
+            dir_touch(filenum);
+        }
+        else
+            fat_set(prev, next);
+        if (tail_block[filenum] == old[nold - 1])
+            tail_block[filenum] = prev;
+    }
+    for (i = 0; i < nold; i++)
+    {
+        if (i < reuse)
+            blocks[i] = old[i];
+        else
+        {
+            cache_drop(fs.data_idx + old[i]); // stale from now on
+            free_block(old[i]); // held until the next commit if a committed file may hold it
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        lidx_set(blocks[i], idx[i]);
+        link_block(&cur, blocks[i], idx[i] & ~LIDX_COMP);
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    for (i = 0; i < MAX_FD; i++)
+        if (fildesA[i].used && fildesA[i].file == filenum && fildesA[i].cur_idx >= first)
+            fildesA[i].cur_block = -1;
+    if (own != NULL && own->cur_idx >= first)
+        own->cur_block = -1;
+
+    for (i = 0; i < n; i++)
+    {
+        blocks[i] += fs.data_idx;
+        cache_drop(blocks[i]); // stale, or cached from a previous owner
+    }
+    int ret = data_writev(blocks, bufs, n) == n ? 0 : -1;
+    free(z);
+    if (ret != 0)
+        fprintf(stderr, "%s: Failed to write block to disk.\n", who);
+    return ret;
+}
+
+/*Allocates the block buffered for file filenum and writes the buffer to it; on a compressed disk
+the buffered cluster is stored. fd, if not NULL, is a descriptor whose cursor must stay valid.
+The caller holds the file's lock for writing, or ns_lock exclusively.*/
+static int dalloc_flush(int filenum, struct file_descriptor *fd)
+{
+    struct delalloc *d = &dalloc[filenum];
+    if (d->data == NULL)
+        return 0;
+    if (fs.comp_cluster)
+    {
+        if (cluster_store(filenum, d->idx, d->data, 0, fd, "fs_write") != 0)
+            return -1;
+        dalloc_drop(filenum);
+        return 0;
+    }
+
+    struct file_descriptor cur; // where to link the block, found from the tail if possible
+    cur.file = filenum;
+    cur.cur_block = -1;
+    cur.cur_idx = 0;
+    int tail = tail_block[filenum];
+    if (tail != -1 && block_index(tail) < d->idx)
+    {
+        cur.cur_block = tail;
+        cur.cur_idx = block_index(tail);
+    }
+    else
+        fd_block(&cur, d->idx);
+
+    pthread_mutex_lock(&meta_lock);
+    dalloc_unreserve(filenum);
+    int block = alloc_file_block(filenum);
+    if (block != -1)
+    {
+        lidx_set(block, d->idx);
+        link_block(&cur, block, d->idx);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (block == -1)
+    {
+        no_space("fs_write");
+        return -1;
+    }
+    if (cache_modify(fs.data_idx + block, 1, 0, d->data, fs.block_size, filenum, "fs_write") != 0)
+    {
+        fprintf(stderr, "fs_write: Failed to write block to disk.\n");
+        return -1;
+    }
+    dalloc_drop(filenum);
+    return 0;
+}
+
+static size_t dalloc_size(void)
+{
+    return fs.comp_cluster ? (size_t)fs.comp_cluster * fs.block_size : (size_t)fs.block_size;
+}
+
+/*Makes the buffer of the file behind fd hold idx, flushing a buffer of another block first. A
+new buffer of a cluster is filled with what the cluster holds. A new buffer sets aside as many
+free blocks as it holds, which covers any flush, and fails if the disk has not got them; the
+unused part of the file's extent reservation is freed first when it is needed to make up the
+room.*/
+static int dalloc_hold(struct file_descriptor *fd, int idx)
+{
+    struct delalloc *d = &dalloc[fd->file];
+    if (d->data != NULL && d->idx == idx)
+        return 0;
+    if (dalloc_flush(fd->file, fd) != 0)
+        return -1;
+    if ((d->data = (char *)calloc(1, dalloc_size())) == NULL)
+        return -1;
+    if (fs.comp_cluster && cluster_load(fd, idx, d->data, 0, fs.comp_cluster, "fs_write") != 0)
+    {
+        free(d->data);
+        d->data = NULL;
+        return -1;
+    }
+    d->idx = idx;
+
+    int need = dalloc_size() / fs.block_size;
+    pthread_mutex_lock(&meta_lock);
+    if (!room_for(need) && resv[fd->file].next < resv[fd->file].end)
+        release_resv(fd->file); // the blocks the file has set aside count as room for its buffer
+    pthread_mutex_lock(&dedup_lock);
+    int ok = free_blocks - dalloc_resv >= need &&
+             (fs.pmap_len == 0 || phys_free - dalloc_resv >= need);
+    if (ok)
+    {
+        dalloc_resv += need;
+        d->resv = need;
+        dalloc_cnt++;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    pthread_mutex_unlock(&meta_lock);
+    if (!ok)
+    {
+        free(d->data);
+        d->data = NULL;
+        no_space("fs_write");
+        return -1;
+    }
+    return 0;
+}
+
+/*Copies len bytes to off within the buffered block, or cluster, idx of the file behind fd. A
+buffer that is filled to its end is flushed right away.*/
+static int dalloc_put(struct file_descriptor *fd, int idx, size_t off, const char *buf, size_t len)
+{
+    if (dalloc_hold(fd, idx) != 0)
+        return -1;
+    memcpy(dalloc[fd->file].data + off, buf, len);
+    if (off + len == dalloc_size())
+        return dalloc_flush(fd->file, fd);
+    return 0;
+}
+
+/*Flushes the buffers of every file. Called with ns_lock held exclusively.*/
+static int dalloc_flush_all(void)
+{
+    int i, ret = 0;
+    for (i = 0; dalloc_cnt > 0 && i < fs.dir_cap; i++)
+        if (dalloc_flush(i, NULL) != 0)
+            ret = -1;
+    return ret;
+}
+
+static int flush_all(void)
+{
+    int ret = dalloc_flush_all();
+    if (cache_flush(-1) != 0)
+        ret = -1;
+    return ret;
+}
+
+/*Writes every buffered small write and every dirty block in the cache back to the disk, which
+also releases the memory held by delayed allocation. Returns 0 on success, -1 if a block could
+not be written.*/
+int fs_flush(void)
+{
+    if (FAT == NULL)
+        return 0;
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = flush_all();
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+/*Turns delayed allocation of small writes on or off; it is off by default. Turning it off
+flushes what is buffered. Compressed disks always buffer partial writes of a cluster.*/
+int fs_set_delalloc(int enable)
+{
+    int ret = 0;
+    pthread_rwlock_wrlock(&ns_lock);
+    delalloc_on = enable != 0;
+    if (!delalloc_on && FAT != NULL)
+        ret = dalloc_flush_all();
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+/*Sets the number of blocks held by the block cache; 0 turns caching off. If a file system is
+mounted, its cache is flushed and rebuilt with the new size.*/
+int fs_set_cache_size(int nblocks)
+{
+    if (nblocks < 0)
+    {
+        fprintf(stderr, "fs_set_cache_size: Invalid cache size.\n");
+        return -1;
+    }
+    int ret = 0;
+    pthread_rwlock_wrlock(&ns_lock); // no file is being read or written
+    if (FAT != NULL && flush_all() != 0)
+        ret = -1;
+    else
+    {
+        cache_destroy();
+        cache_size = nblocks;
+        if (FAT != NULL)
+            ret = cache_init();
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
 
-struct super_block fs;
-struct file_descriptor fildesA[MAX_FD]; // 32
-int *FAT;                               // Will be populated with the FAT data
-struct dir_entry *DIR;                  // Will be populated with the directory data
+/*Releases everything mount_fs allocated.*/
+static void free_fs_state(void)
+{
+    cache_destroy();
+    int i;
+    for (i = 0; dalloc != NULL && i < fs.dir_cap; i++)
+        free(dalloc[i].data);
+    free(dalloc);
+    dalloc = NULL;
+    free(used_map);
+    free(freed_map);
+    free(taken_map);
+    free(tail_block);
+    free(resv);
+    used_map = NULL;
+    freed_map = taken_map = NULL;
+    tail_block = NULL;
+    resv = NULL;
+    free_dir_index();
+    file_locks_free();
+    free(FAT);
+    free(DIR);
+    free(dir_blocks);
+    free(fat_dirty);
+    free(LIDX);
+    free(CSUM);
+    free(PMAP);
+    free(REFS);
+    free(fp_head);
+    free(fp_next);
+    free(lidx_dirty);
+    free(pmap_dirty);
+    free(dir_dirty);
+    FAT = NULL;
+    DIR = NULL;
+    dir_blocks = NULL;
+    fat_dirty = NULL;
+    LIDX = NULL;
+    CSUM = NULL;
+    PMAP = NULL;
+    REFS = NULL;
+    fp_head = NULL;
+    fp_next = NULL;
+    lidx_dirty = NULL;
+    pmap_dirty = NULL;
+    dir_dirty = NULL;
+    free(jnl_tx);
+    free(jnl_home);
+    jnl_tx = NULL;
+    jnl_home = NULL;
+}
 
 /*This function creates a fresh (and empty) file system on the virtual disk with name disk_name.
 As part of this function, you should first invoke make_disk(disk_name) to create a new disk.
@@ -52,50 +2411,159 @@ that it can be later used (mounted). The function returns 0 on success, and -1 i
 disk_name could not be created, opened, or properly initialized.*/
 int make_fs(char *disk_name)
 {
-    if (make_disk(disk_name) < 0)
+    return make_fs_opts(disk_name, NULL);
+}
+
+/*Same as make_fs, with format-time options. opts may be NULL, and zeroed fields keep their
+defaults.*/
+int make_fs_opts(char *disk_name, struct fs_options *opts)
+{
+    struct fs_options defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (opts == NULL)
+        opts = &defaults;
+    if (opts->alloc_policy != FS_ALLOC_FIRST_FIT && opts->alloc_policy != FS_ALLOC_EXTENT)
     {
-        fprintf(stderr, "make_fs: Failed to create the disk '%s'.\n", disk_name);
+        fprintf(stderr, "make_fs: Invalid allocation policy.\n");
         return -1;
     }
-    if (open_disk(disk_name) < 0)
+    if (opts->extent_blocks < 0)
     {
-        fprintf(stderr, "make_fs: Failed to open the disk '%s'.\n", disk_name);
+        fprintf(stderr, "make_fs: Invalid extent length.\n");
+        return -1;
+    }
+    if (opts->journal_blocks != 0 && opts->journal_blocks != -1 && opts->journal_blocks < 3)
+    {
+        fprintf(stderr, "make_fs: A journal needs at least 3 blocks.\n");
+        return -1;
+    }
+    if (opts->checksums != 0 && opts->checksums != -1)
+    {
+        fprintf(stderr, "make_fs: Invalid checksum option.\n");
+        return -1;
+    }
+    if (opts->compress != 0 && (opts->compress < 2 || opts->compress > MAX_CLUSTER ||
+                                (opts->compress & (opts->compress - 1)) != 0))
+    {
+        fprintf(stderr, "make_fs: Cluster size must be a power of two between 2 and %d.\n",
+                MAX_CLUSTER);
         return -1;
     }
-    fs.data_idx = DISK_BLOCKS / 2;
-
-    fs.dir_idx = sizeof(fs) / BLOCK_SIZE + 1;
-    
 
-    fs.dir_len = (MAX_FILES * sizeof(struct dir_entry)) / BLOCK_SIZE + 1;
+    if (opts->dedup < 0 || opts->dedup > MAX_DEDUP)
+    {
+        fprintf(stderr, "make_fs: Dedup factor must be between 1 and %d.\n", MAX_DEDUP);
+        return -1;
+    }
+    if (opts->dedup && opts->checksums == -1) // contents are found by their checksums
+    {
+        fprintf(stderr, "make_fs: Deduplication needs checksums.\n");
+        return -1;
+    }
 
-    fs.fat_idx = fs.dir_idx + fs.dir_len + 1;
+    int bsize = opts->block_size ? opts->block_size : BLOCK_SIZE;
+    long long dsize = opts->disk_size ? opts->disk_size : (long long)DISK_BLOCKS * BLOCK_SIZE;
+    if (bsize < MIN_BLOCK_SIZE || bsize > MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0)
+    {
+        fprintf(stderr, "make_fs: Block size must be a power of two between %d and %d.\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (dsize < MIN_DISK_SIZE || dsize / bsize > MAX_DISK_BLOCKS)
+    {
+        fprintf(stderr, "make_fs: Invalid disk size.\n");
+        return -1;
+    }
 
-    fs.fat_len = ((DISK_BLOCKS - fs.data_idx) * sizeof(int)) / BLOCK_SIZE + 1;
+    memset(&fs, 0, sizeof(fs));
+    fs.magic = FS_MAGIC;
+    fs.block_size = bsize;
+    fs.disk_blocks = dsize / bsize;
 
-    // FAT = calloc(fs.fat_len * BLOCK_SIZE, 1);
-    // DIR = calloc(fs.dir_len * BLOCK_SIZE, 1);
+    if (make_disk_geom(disk_name, fs.disk_blocks, fs.block_size) < 0)
+    {
+        fprintf(stderr, "make_fs: Failed to create the disk '%s'.\n", disk_name);
+        return -1;
+    }
+    if (open_disk(disk_name) < 0 || disk_set_block_size(fs.block_size) < 0)
+    {
+        fprintf(stderr, "make_fs: Failed to open the disk '%s'.\n", disk_name);
+        return -1;
+    }
 
-    char buffer[BLOCK_SIZE];
-    memset(buffer, '\0', BLOCK_SIZE);
+    // One FAT entry per disk block keeps the layout a single pass; with dedup, chains get dedup
+    // times as many. The journal directly follows the super block, then come the FAT, the
+    // logical index table, the checksum table, the block map and the data blocks.
+    int table_len = ((long long)fs.disk_blocks * sizeof(int) + fs.block_size - 1) / fs.block_size;
+    long long nodes = (long long)opts->dedup * fs.disk_blocks;
+    fs.nodes = nodes < MAX_DISK_BLOCKS ? nodes : MAX_DISK_BLOCKS;
+    fs.fat_len = table_len;
+    if (opts->dedup)
+        fs.fat_len = ((long long)fs.nodes * sizeof(int) + fs.block_size - 1) / fs.block_size;
+    fs.lidx_len = fs.fat_len;
+    fs.csum_len = opts->checksums == -1 ? 0 : table_len;
+    fs.pmap_len = opts->dedup ? fs.fat_len : 0;
 
-    memcpy(buffer, &fs, sizeof(struct super_block));
-    if (block_write(0, buffer) != 0) // write super block to disk
+    // A commit must fit in the journal, with room for at least one directory block (jnl_room).
+    // By default there is room for the blocks that let the directory grow without bound, or on
+    // a small disk for a directory of 1/16 of the disk.
+    int tx = fs.fat_len + fs.lidx_len + fs.pmap_len + 1;
+    long long jnl_min = 1 + jnl_commit_blocks(tx + 1);
+    int room = fs.disk_blocks / 16 < MAX_FD + 2 ? fs.disk_blocks / 16 : MAX_FD + 2;
+    fs.jnl_idx = 1;
+    fs.jnl_len = opts->journal_blocks;
+    if (fs.jnl_len == 0)
+    {
+        fs.jnl_len = fs.disk_blocks / 16 < JOURNAL_BLOCKS ? fs.disk_blocks / 16 : JOURNAL_BLOCKS;
+        if (room < 1)
+            room = 1;
+        if (fs.jnl_len < 3)
+            fs.jnl_len = 0;
+        else if (fs.jnl_len < 1 + jnl_commit_blocks(tx + room))
+            fs.jnl_len = 1 + jnl_commit_blocks(tx + room);
+    }
+    else if (fs.jnl_len == -1)
+        fs.jnl_len = 0;
+    else if (fs.jnl_len < jnl_min)
+    {
+        fprintf(stderr, "make_fs: The journal needs at least %lld blocks.\n", jnl_min);
+        close_disk();
         return -1;
+    }
+    fs.fat_idx = fs.jnl_idx + fs.jnl_len;
+    fs.lidx_idx = fs.fat_idx + fs.fat_len;
+    fs.csum_idx = fs.lidx_idx + fs.lidx_len;
+    fs.pmap_idx = fs.csum_idx + fs.csum_len;
+    fs.data_idx = fs.pmap_idx + fs.pmap_len;
 
-    memset(buffer, 0, BLOCK_SIZE);
-    int i;
-    for (i = fs.dir_idx; i < fs.dir_idx + fs.dir_len; i++) // initialize the directory
+    fs.dir_head = 0; // the directory starts as the first data block
+    fs.dir_len = 1;
+    fs.dir_cap = DIR_PER_BLOCK;
+
+    fs.alloc_policy = opts->alloc_policy;
+    fs.extent_blocks = opts->extent_blocks ? opts->extent_blocks : EXTENT_BLOCKS;
+    fs.comp_cluster = opts->compress;
+
+    // A fresh disk reads back as zeros, which is an empty FAT, an empty directory, an empty
+    // journal and a block map holding the directory block, so only the super block and the
+    // first FAT block are written, as one request.
+    char *meta = (char *)calloc(2, fs.block_size);
+    if (meta == NULL)
     {
-        if (block_write(i, buffer) != 0)
-            return -1;
+        close_disk();
+        return -1;
     }
+    memcpy(meta, &fs, sizeof(struct super_block));
+    ((int *)(meta + fs.block_size))[fs.dir_head] = -1; // directory chain is one block long
 
-    memset(buffer, '\0', BLOCK_SIZE);
-    for (i = fs.fat_idx; i < fs.fat_idx + fs.fat_len; i++) // initialize the FAT
+    int blocks[2] = {0, fs.fat_idx};
+    char *bufs[2] = {meta, meta + fs.block_size};
+    int ret = block_writev(blocks, bufs, 2); // write super block and FAT
+    free(meta);
+    if (ret != 0)
     {
-        if (block_write(i, buffer) != 0)
-            return -1;
+        close_disk();
+        return -1;
     }
 
     if (close_disk() != 0)
@@ -118,144 +2586,290 @@ int mount_fs(char *disk_name)
         return -1;
     }
 
-    char buffer[BLOCK_SIZE];
+    char buffer[BLOCK_SIZE]; // the disk is opened with the default block size
     memset(buffer, '\0', BLOCK_SIZE);
 
     if (block_read(0, buffer) != 0) // load super block from disk
+    {
+        close_disk();
         return -1;
+    }
     memcpy(&fs, buffer, sizeof(struct super_block));
-
-    FAT = (int *)malloc(fs.fat_len * BLOCK_SIZE);
-    if (FAT == NULL)
+    if (fs.magic != FS_MAGIC || fs.block_size < MIN_BLOCK_SIZE || fs.block_size > MAX_BLOCK_SIZE ||
+        fs.comp_cluster < 0 || fs.comp_cluster > MAX_CLUSTER ||
+        (fs.comp_cluster && fs.lidx_len == 0) ||
+        (fs.pmap_len && (fs.csum_len == 0 || fs.nodes <= 0)) ||
+        (fs.jnl_len > 0 && jnl_room() < 1) ||
+        disk_set_block_size(fs.block_size) != 0)
+    {
+        fprintf(stderr, "mount_fs: Disk '%s' does not contain a valid file system.\n", disk_name);
+        close_disk();
         return -1;
-    int i;
-    for (i = 0; i < fs.fat_len; i++) // load FAT from disk
+    }
+
+    if (fs.jnl_len > 0) // finish the transactions committed before a crash
     {
-        if (block_read(fs.fat_idx + i, buffer) != 0)
+        char super[fs.block_size];
+        if (jnl_replay() != 0 || block_read(0, super) != 0)
         {
-            free(FAT);
+            fprintf(stderr, "mount_fs: Failed to replay the journal.\n");
+            close_disk();
             return -1;
         }
-        memcpy(FAT + (i * (BLOCK_SIZE / sizeof(int))), buffer, BLOCK_SIZE); // copy buffer to FAT array indexes
+        memcpy(&fs, super, sizeof(struct super_block)); // the super block may have been replayed
+        jnl_tx = (char *)malloc((size_t)jnl_tx_blocks() * fs.block_size);
+        jnl_home = (int *)malloc(fs.jnl_len * sizeof(int));
     }
 
-    DIR = (struct dir_entry *)malloc(fs.dir_len * BLOCK_SIZE);
-    if (DIR == NULL)
+    FAT = (int *)malloc((size_t)fs.fat_len * fs.block_size);
+    DIR = (struct dir_entry *)malloc((size_t)fs.dir_len * fs.block_size);
+    dir_blocks = (int *)malloc(fs.dir_len * sizeof(int));
+    fat_dirty = (unsigned char *)calloc(fs.fat_len, 1);
+    LIDX = (int *)calloc(fs.fat_len, fs.block_size);
+    if (fs.csum_len > 0)
+        CSUM = (unsigned int *)malloc((size_t)fs.csum_len * fs.block_size);
+    if (fs.pmap_len > 0)
     {
-        return -1;
-        free(FAT);
+        PMAP = (int *)malloc((size_t)fs.pmap_len * fs.block_size);
+        pmap_dirty = (unsigned char *)calloc(fs.pmap_len, 1);
     }
-
-    for (i = 0; i < fs.dir_len; i++) // load DIR from disk
+    lidx_dirty = (unsigned char *)calloc(fs.fat_len, 1);
+    dir_dirty = (unsigned char *)calloc(fs.dir_len, 1);
+    dir_dirty_cnt = 0;
+    super_dirty = 0;
+    int ok = FAT != NULL && DIR != NULL && dir_blocks != NULL && fat_dirty != NULL &&
+             dir_dirty != NULL &&
+             LIDX != NULL && lidx_dirty != NULL &&
+             (fs.lidx_len == 0 || block_read_range(fs.lidx_idx, fs.lidx_len, (char *)LIDX) == 0) &&
+             (fs.csum_len == 0 ||
+              (CSUM != NULL && block_read_range(fs.csum_idx, fs.csum_len, (char *)CSUM) == 0)) &&
+             (fs.pmap_len == 0 ||
+              (PMAP != NULL && pmap_dirty != NULL &&
+               block_read_range(fs.pmap_idx, fs.pmap_len, (char *)PMAP) == 0)) &&
+             (fs.jnl_len == 0 || (jnl_tx != NULL && jnl_home != NULL)) &&
+             block_read_range(fs.fat_idx, fs.fat_len, (char *)FAT) == 0; // load FAT from disk
+    if (ok)
     {
-        if (block_read(fs.dir_idx + i, buffer) != 0)
+        int i, block = fs.dir_head;
+        for (i = 0; i < fs.dir_len && block != -1; i++) // follow the directory chain
         {
-            free(FAT);
-            free(DIR);
-            return -1;
+            dir_blocks[i] = block;
+            block = FAT[block];
         }
-        memcpy((char *)DIR + (i * BLOCK_SIZE), buffer, BLOCK_SIZE); // copy buffer to DIR array indexes
+        ok = i == fs.dir_len && dir_load() == 0; // load DIR from disk
+    }
+    if (!ok)
+    {
+        free_fs_state();
+        close_disk();
+        return -1;
+    }
+    if (build_dir_index() != 0 || build_alloc_state() != 0 || cache_init() != 0 ||
+        file_locks_init(fs.dir_cap) != 0)
+    {
+        fprintf(stderr, "mount_fs: Failed to allocate the in-memory state.\n");
+        free_fs_state();
+        close_disk();
+        return -1;
+    }
+    int i;
+    for (i = 0; i < MAX_FD; i++) // initialize fds
+    {
+        fildesA[i].used = 0;
+        pthread_mutex_init(&fildesA[i].lock, NULL);
     }
-    memset(fildesA, 0, sizeof(fildesA)); // initialize fds
-    // for (i = 0; i < MAX_FD; i++) {
-    //     fildesA[i].used = 0;
-    // }
     return 0;
 }
 
 int umount_fs(char *disk_name)
 {
-
-    char buffer[BLOCK_SIZE];
-    memset(buffer, '\0', BLOCK_SIZE);
     int i;
-    if (FAT != NULL) {
-        for (i = 0; i < fs.fat_len; i++) {
-            memcpy(buffer, FAT + (i * (BLOCK_SIZE / sizeof(int))), BLOCK_SIZE);
-            if (block_write(fs.fat_idx + i, buffer) != 0)
-                return -1;
-        }
-        free(FAT);
-        FAT = NULL;
-    }
-
-    if (DIR != NULL) {
-        for (i = 0; i < fs.dir_len; i++) {
-            memcpy(buffer, (char *)DIR + (i * BLOCK_SIZE), BLOCK_SIZE);
-            if (block_write(fs.dir_idx + i, buffer) != 0)
-                return -1;
-        }
-        free(DIR);
-        DIR = NULL;
-    }
-
     for (i = 0; i < MAX_FD; i++)
-        fs_close(i); // Close file descriptors
+        if (fildesA[i].used)
+            fs_close(i); // Close file descriptors
+
+    if (fs_sync() != 0) // write back cached data blocks and dirty metadata
+        return -1;
+    if (fs.jnl_len > 0 && jnl_checkpoint() != 0) // leave an empty journal behind
+        return -1;
+    free_fs_state();
 
     if (close_disk() < 0) {
         fprintf(stderr, "unmount_fs: Failed to close the disk.\n");
         return -1;
     }
 
+    // The descriptor locks go last, so that a failed unmount leaves them usable
+    for (i = 0; i < MAX_FD; i++)
+        pthread_mutex_destroy(&fildesA[i].lock);
     return 0;
 }
 
 
-int fs_open(char *name)
+/*Returns the descriptor fildes with its lock held, or NULL if fildes is not open.*/
+static struct file_descriptor *fd_get(int fildes, const char *who)
 {
-    int filenum = -1;
-    int i;
-    for (i = 0; i < MAX_FILES; i++)
+    if (fildes >= 0 && fildes < MAX_FD)
     {
-        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) // check if file exists in DIR
-        {
-            filenum = i;
-            break;
-        }
+        struct file_descriptor *fd = &fildesA[fildes];
+        pthread_mutex_lock(&fd->lock);
+        if (fd->used)
+            return fd;
+        pthread_mutex_unlock(&fd->lock);
     }
-    if (filenum == -1)
+    fprintf(stderr, "%s: Invalid file descriptor.\n", who);
+    return NULL;
+}
+
+/*Locks the file behind fd, whose lock is held, for reading or, if excl is set, for writing.*/
+static void file_enter(struct file_descriptor *fd, int excl)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    if (excl)
+        pthread_rwlock_wrlock(&file_lock[fd->file]);
+    else
+        pthread_rwlock_rdlock(&file_lock[fd->file]);
+}
+
+/*Releases the locks taken by fd_get and file_enter.*/
+static void file_leave(struct file_descriptor *fd)
+{
+    pthread_rwlock_unlock(&file_lock[fd->file]);
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_mutex_unlock(&fd->lock);
+}
+
+/*Makes the file system durable: buffered small writes and cached data blocks are written back,
+then the dirty FAT and directory blocks, and the disk is synced. Returns 0 on success, -1 on
+failure.*/
+int fs_sync(void)
+{
+    if (FAT == NULL)
     {
-        fprintf(stderr, "fs_open: File '%s' not found.\n", name);
+        fprintf(stderr, "fs_sync: No file system is mounted.\n");
         return -1;
     }
-    
-    int fdnum = -1;
-    for (i = 0; i < MAX_FD; i++)
+    pthread_rwlock_wrlock(&ns_lock); // metadata stays consistent while it is written
+    int ret = flush_all() != 0 || sync_meta() != 0 || disk_sync() != 0 ? -1 : 0;
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+/*Blocks an allocation can still take: data blocks on a dedup disk, FAT entries otherwise.*/
+static int free_space(void)
+{
+    return (fs.pmap_len > 0 ? phys_free : free_blocks) - dalloc_resv;
+}
+
+/*Commits the metadata if blocks freed since the last commit are held, so that an allocation
+that ran out of space can be retried. Called with ns_lock held exclusively. Returns 1 if the
+commit left more blocks to allocate than there were before.*/
+static int commit_freed(void)
+{
+    if (freed_cnt == 0)
+        return 0;
+    int before = free_space();
+    return flush_all() == 0 && sync_meta() == 0 && disk_sync() == 0 && free_space() > before;
+}
+
+/*Commits the metadata before a namespace operation if the directory blocks dirty so far, those
+the open files can still dirty and the two the operation can dirty might not fit in one
+transaction (jnl_room). Called with ns_lock held exclusively; fs_open counts too, as it adds an
+open file.*/
+static int dir_make_room(void)
+{
+    if (fs.jnl_len == 0 || fs.dir_len + 1 <= jnl_room() ||
+        dir_dirty_cnt + MAX_FD + 2 <= jnl_room())
+        return 0;
+    return flush_all() == 0 && sync_meta() == 0 && disk_sync() == 0 ? 0 : -1;
+}
+
+/*Like fs_sync, but only the buffered and cached data blocks of the file behind fildes are written
+back, along with the cached blocks other files have just been given, which the commit links.*/
+int fs_fsync(int fildes)
+{
+    struct file_descriptor *fd = fd_get(fildes, "fs_fsync");
+    if (fd == NULL)
+        return -1;
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = dalloc_flush(fd->file, NULL) != 0 || cache_flush(fd->file) != 0 || sync_meta() != 0 ||
+              disk_sync() != 0 ? -1 : 0;
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_mutex_unlock(&fd->lock);
+    return ret;
+}
+
+int fs_open(char *name)
+{
+    int i, filenum = -1;
+    struct file_descriptor *fd = NULL;
+    for (i = 0; i < MAX_FD && fd == NULL; i++) // find an unused fd, keeping it locked
     {
-        if (!fildesA[i].used) // find an unused fd
-        {
-            fdnum = i;
-            fildesA[i].used = 1;
-            fildesA[i].file = filenum;
-            fildesA[i].offset = 0;
-            break;
-        }
+        pthread_mutex_lock(&fildesA[i].lock);
+        if (!fildesA[i].used)
+            fd = &fildesA[i];
+        else
+            pthread_mutex_unlock(&fildesA[i].lock);
     }
-    if (fdnum == -1)
+    if (fd == NULL)
     {
         fprintf(stderr, "fs_open: No available file descriptors.\n");
         return -1;
     }
-    DIR[filenum].ref_cnt++;
-    return fdnum;
-}
 
-int fs_close(int fildes)
-{
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
+    pthread_rwlock_wrlock(&ns_lock);
+    filenum = dir_lookup(name); // check if file exists in DIR
+    if (filenum != -1 && dir_make_room() != 0)
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        pthread_mutex_unlock(&fd->lock);
+        return -1;
+    }
+    if (filenum != -1)
+    {
+        DIR[filenum].ref_cnt++;
+        fd->used = 1;
+        fd->file = filenum;
+        fd->offset = 0;
+        fd->cur_block = -1;
+        fd->cur_idx = 0;
+        fd->ra_next = 0;
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_mutex_unlock(&fd->lock);
+
+    if (filenum == -1)
     {
-        fprintf(stderr, "fs_close: Invalid file descriptor.\n");
+        fprintf(stderr, "fs_open: File '%s' not found.\n", name);
         return -1;
     }
+    return fd - fildesA;
+}
 
-    fildesA[fildes].used = 0;
-    fildesA[fildes].file = -1;
-    fildesA[fildes].offset = 0;
+int fs_close(int fildes)
+{
+    struct file_descriptor *fd = fd_get(fildes, "fs_close");
+    if (fd == NULL)
+        return -1;
 
-    if (DIR[fildesA[fildes].file].used)
-        DIR[fildesA[fildes].file].ref_cnt--;
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = 0;
+    if (DIR[fd->file].used && dalloc_flush(fd->file, NULL) != 0)
+    {
+        dalloc_drop(fd->file); // the descriptor is closed anyway, and the data is lost
+        ret = -1;
+    }
+    if (DIR[fd->file].used && --DIR[fd->file].ref_cnt == 0)
+        release_resv(fd->file); // return unused reserved blocks
+    fd->used = 0; // fs_truncate looks at other descriptors under ns_lock
+    fd->file = -1;
+    fd->offset = 0;
+    pthread_rwlock_unlock(&ns_lock);
+    pthread_mutex_unlock(&fd->lock);
 
-    return 0;
+    return ret;
 }
 
 int fs_create(char *name)
@@ -267,197 +2881,511 @@ int fs_create(char *name)
         return -1;
     }
 
-    int i;
-    for (i = 0; i < MAX_FILES; i++)
+    pthread_rwlock_wrlock(&ns_lock);
+    if (dir_lookup(name) != -1)
     {
-        if (memcmp(DIR[i].name, name, strlen(name)) == 0)
-        {
-            fprintf(stderr, "fs_create: File '%s' already exists.\n", name);
-            return -1;
-        }
+        pthread_rwlock_unlock(&ns_lock);
+        fprintf(stderr, "fs_create: File '%s' already exists.\n", name);
+        return -1;
     }
-
-    int freeIND = -1;
-    for (i = 0; i < MAX_FILES; i++) // find a free slot
+    if (dir_make_room() != 0)
     {
-        if (DIR[i].used == 0)
-        {
-            freeIND = i;
-            break;
-        }
+        pthread_rwlock_unlock(&ns_lock);
+        return -1;
     }
-    if (freeIND == -1)
+
+    if (nfree_slots == 0 && dir_grow() != 0 && (!commit_freed() || dir_grow() != 0))
     {
+        pthread_rwlock_unlock(&ns_lock);
         fprintf(stderr, "fs_create: No free slots in the directory.\n");
         return -1;
     }
+    int freeIND = free_slots[--nfree_slots]; // take a free slot
 
     DIR[freeIND].used = 1;
     DIR[freeIND].size = 0;
     DIR[freeIND].head = -1;
     DIR[freeIND].ref_cnt = 0;
+    memset(DIR[freeIND].name, '\0', sizeof(DIR[freeIND].name));
     memcpy(DIR[freeIND].name, name, strlen(name));
-    // DIR[free_idx].name[MAX_F_NAME] = '\0';
+    dir_touch(freeIND);
+    dir_index_add(freeIND);
+    pthread_rwlock_unlock(&ns_lock);
 
     return 0;
 }
 
 int fs_delete(char *name)
 {
-    int i;
-    for (i = 0; i < MAX_FILES; i++)
+    pthread_rwlock_wrlock(&ns_lock);
+    int i = dir_lookup(name);
+    if (i == -1)
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        return -1;
+    }
+
+    if (DIR[i].ref_cnt > 0)
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        fprintf(stderr, "fs_delete: File '%s' is open.\n", name);
+        return -1;
+    }
+    if (dir_make_room() != 0)
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        return -1;
+    }
+
+    int block = DIR[i].head;
+    while (block != -1) // free all blocks in the file
+    {
+        int nextblock = FAT[block];
+        free_block(block);
+        block = nextblock;
+    }
+
+    dir_index_remove(i);
+    DIR[i].used = 0;
+    DIR[i].size = 0;
+    DIR[i].head = -1;
+    DIR[i].ref_cnt = 0;
+    memset(DIR[i].name, '\0', strlen(name));
+    dir_touch(i);
+    tail_block[i] = -1;
+    free_slots[nfree_slots++] = i;
+    pthread_rwlock_unlock(&ns_lock);
+
+    return 0;
+}
+
+/*Creates the file dst as a copy of src that shares its data blocks: every block of src gets a FAT
+entry in dst mapped to the same data block, so no file data is read or written. Each file keeps
+its own chain, and a shared block is copied when either file writes it, so later writes and
+truncations of one file leave the other alone. Needs a disk formatted with dedup. Returns 0 on
+success, -1 on failure.*/
+int fs_clone(char *src, char *dst)
+{
+    if (strlen(dst) > MAX_F_NAME)
+    {
+        fprintf(stderr, "fs_clone: File name too long.\n");
+        return -1;
+    }
+    if (fs.pmap_len == 0)
+    {
+        fprintf(stderr, "fs_clone: Not supported on a file system formatted without dedup.\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    int from = dir_lookup(src);
+    if (from == -1 || dir_lookup(dst) != -1)
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        if (from == -1)
+            fprintf(stderr, "fs_clone: File '%s' not found.\n", src);
+        else
+            fprintf(stderr, "fs_clone: File '%s' already exists.\n", dst);
+        return -1;
+    }
+    // Data of src still buffered or cached has to reach its data blocks first
+    if (dir_make_room() != 0 || dalloc_flush(from, NULL) != 0 || cache_flush(from) != 0 ||
+        (nfree_slots == 0 && dir_grow() != 0 && (!commit_freed() || dir_grow() != 0)))
+    {
+        pthread_rwlock_unlock(&ns_lock);
+        fprintf(stderr, "fs_clone: Failed to create '%s'.\n", dst);
+        return -1;
+    }
+    int to = free_slots[--nfree_slots];
+    DIR[to].used = 1;
+    DIR[to].size = DIR[from].size;
+    DIR[to].head = -1;
+    DIR[to].ref_cnt = 0;
+    memset(DIR[to].name, '\0', sizeof(DIR[to].name));
+    memcpy(DIR[to].name, dst, strlen(dst));
+
+    struct file_descriptor cur; // appends to the chain of dst
+    cur.file = to;
+    cur.cur_block = -1;
+    cur.cur_idx = 0;
+    int block, copy = 0;
+    pthread_mutex_lock(&meta_lock);
+    for (block = DIR[from].head; block != -1; block = FAT[block])
+    {
+        if ((copy = alloc_chain_block(to)) == -1)
+            break;
+        lidx_set(copy, LIDX[block]);
+        link_block(&cur, copy, block_index(block));
+        pthread_mutex_lock(&dedup_lock);
+        pmap_set(copy, PMAP[block]);
+        REFS[PMAP[block]]++;
+        pthread_mutex_unlock(&dedup_lock);
+    }
+    release_resv(to);
+    if (copy == -1) // out of FAT entries: give back those taken
     {
-        if (DIR[i].used && strcmp(DIR[i].name, name) == 0)
+        for (block = DIR[to].head; block != -1; block = copy)
         {
-            if (DIR[i].ref_cnt > 0)
-            {
-                fprintf(stderr, "fs_delete: File '%s' is open.\n", name);
-                return -1;
-            }
+            copy = FAT[block];
+            free_block(block);
+        }
+        DIR[to].used = 0;
+        DIR[to].size = 0;
+        DIR[to].head = -1;
+        memset(DIR[to].name, '\0', sizeof(DIR[to].name));
+        tail_block[to] = -1;
+        free_slots[nfree_slots++] = to;
+    }
+    else
+    {
+        dir_touch(to);
+        dir_index_add(to);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    pthread_rwlock_unlock(&ns_lock);
 
-            int block = DIR[i].head;
-            while (block != -1) // free all blocks in the file
-            {
-                int nextblock = FAT[block];
-                FAT[block] = 0;
-                block = nextblock;
-            }
+    if (copy == -1)
+    {
+        fprintf(stderr, "fs_clone: No space left on disk.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*Read-ahead for a descriptor whose last read ended in block last_idx. A read that starts where
+the previous one ended doubles the window, up to RA_MAX blocks and half the cache; any other
+read closes it. Blocks ahead of the stream are prefetched into the cache once less than half
+a window of them is left.*/
+static void read_ahead(struct file_descriptor *fd, off_t start, int last_idx)
+{
+    if (cache == NULL)
+        return;
+    if (start != fd->ra_next)
+    {
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+        return;
+    }
+
+    int max = RA_MAX < cache_size / 2 ? RA_MAX : cache_size / 2;
+    fd->ra_window = fd->ra_window == 0 ? RA_MIN : fd->ra_window * 2;
+    if (fd->ra_window > max)
+        fd->ra_window = max;
+    if (fd->ra_window == 0 || fd->ra_end > last_idx + fd->ra_window / 2)
+        return;
 
-            DIR[i].used = 0;
-            DIR[i].size = 0;
-            DIR[i].head = -1;
-            DIR[i].ref_cnt = 0;
-            memset(DIR[i].name, '\0', strlen(name));
+    int first = fd->ra_end > last_idx + 1 ? fd->ra_end : last_idx + 1;
+    int limit = last_idx + 1 + fd->ra_window;
+    int file_blocks = (DIR[fd->file].size + fs.block_size - 1) / fs.block_size;
+    if (limit > file_blocks)
+        limit = file_blocks;
+    if (first >= limit || fd->cur_block == -1 || fd->cur_idx > first)
+        return;
 
-            return 0;
+    int blocks[IO_BATCH];
+    int n = 0, block = fd->cur_block;
+    while (block != -1 && block_index(block) < first) // walk ahead without moving the cursor
+        block = FAT[block];
+    for (; block != -1 && block_index(block) < limit; block = FAT[block])
+        if (!block_unwritten(block))
+            blocks[n++] = fs.data_idx + block;
+    cache_prefetch(blocks, n);
+    fd->ra_end = limit;
+}
+
+/*file_read and file_write on a compressed disk, where data moves a cluster at a time. Reads
+expand the clusters they touch, or take them from the file's cluster buffer. Writes of whole
+clusters store them right away and other writes go through the buffer.*/
+static int cluster_read(struct file_descriptor *fd, char *buf, size_t nbyte, off_t off)
+{
+    size_t size = (size_t)fs.comp_cluster * fs.block_size;
+    char *tmp = NULL;
+    size_t done = 0;
+    while (done < nbyte)
+    {
+        int c = (off + done) / size;
+        size_t coff = (off + done) % size;
+        size_t len = size - coff < nbyte - done ? size - coff : nbyte - done;
+        struct delalloc *d = &dalloc[fd->file];
+        if (d->data != NULL && d->idx == c)
+            memcpy(buf + done, d->data + coff, len);
+        else
+        {
+            if (tmp == NULL && (tmp = (char *)malloc(size)) == NULL)
+                return -1;
+            if (cluster_load(fd, c, tmp, coff / fs.block_size,
+                             (coff + len + fs.block_size - 1) / fs.block_size, "fs_read") != 0)
+            {
+                free(tmp);
+                return -1;
+            }
+            memcpy(buf + done, tmp + coff, len);
         }
+        done += len;
     }
-    return -1;
+    free(tmp);
+    return done;
 }
 
-int fs_read(int fildes, void *buf, size_t nbyte)
+static int cluster_write(struct file_descriptor *fd, const char *buf, size_t nbyte, off_t off)
 {
-    // Validate file descriptor
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
+    struct dir_entry *file = &DIR[fd->file];
+    size_t size = (size_t)fs.comp_cluster * fs.block_size;
+    size_t done = 0;
+    while (done < nbyte)
     {
-        fprintf(stderr, "fs_read: Invalid file descriptor.\n");
-        return -1;
+        int c = (off + done) / size;
+        size_t coff = (off + done) % size;
+        size_t len = size - coff < nbyte - done ? size - coff : nbyte - done;
+        struct delalloc *d = &dalloc[fd->file];
+        int ret;
+        if (len == size)
+        {
+            if (d->data != NULL && d->idx == c)
+                dalloc_drop(fd->file); // overwritten as a whole
+            ret = cluster_store(fd->file, c, buf + done, 0, fd, "fs_write");
+        }
+        else
+            ret = dalloc_put(fd, c, coff, buf + done, len);
+        if (ret != 0)
+            break;
+        done += len;
     }
-    struct file_descriptor *fd = &fildesA[fildes];
+
+    if (done > 0 && off + (off_t)done > file->size) // nothing written leaves the size alone
+    {
+        file->size = off + done;
+        pthread_mutex_lock(&meta_lock);
+        dir_touch(fd->file);
+        pthread_mutex_unlock(&meta_lock);
+    }
+    return done > 0 || nbyte == 0 ? (int)done : -1;
+}
+
+/*Reads at off from the file of fd, which is locked for reading, moving only the FAT cursor of
+fd. Positional calls pass a private copy of their descriptor.*/
+static int file_read(struct file_descriptor *fd, void *buf, size_t nbyte, off_t off)
+{
     struct dir_entry *file = &DIR[fd->file];
 
     // Handle case when offset is already at the end of the file, no more data
-    if (fd->offset >= file->size)
+    if (off >= file->size)
     {
         return 0;
     }
 
     size_t totalbytes = nbyte;
-    if (fd->offset + nbyte > file->size)
-        totalbytes = file->size - fd->offset; // Adjust bytes to read if reaching EOF
+    if (nbyte > (size_t)(file->size - off))
+        totalbytes = file->size - off; // Adjust bytes to read if reaching EOF
+    if (fs.comp_cluster)
+        return cluster_read(fd, buf, totalbytes, off);
+
+    size_t offset_in_block = off % fs.block_size;
+    int block_idx = off / fs.block_size;
+
+    // Find the correct starting block from the cursor
+    int current_block = fd_block(fd, block_idx);
+
+    size_t bytes_read = 0;
+    int blocks[IO_BATCH];
+    char *bufs[IO_BATCH];
+    size_t offs[IO_BATCH], lens[IO_BATCH];
+    char edge[2][fs.block_size]; // partial blocks at either end of a batch
+
+    // Read the data in batches of uncached blocks, each batch as one vectored request
+    while (totalbytes > 0)
+    { 
+        size_t bytes_from_block = fs.block_size - offset_in_block;
+        if (bytes_from_block > totalbytes)
+        {
+            bytes_from_block = totalbytes;
+        }
 
-    int current_block = file->head;
-    size_t offset_in_block = fd->offset % BLOCK_SIZE;
-    size_t block_offset = fd->offset / BLOCK_SIZE;
+        struct delalloc *d = &dalloc[fd->file];
+        int done = current_block == -1 || block_unwritten(current_block); // holes read as zeros
+        if (done && current_block == -1 && d->data != NULL && d->idx == block_idx)
+            memcpy((char *)buf + bytes_read, d->data + offset_in_block, bytes_from_block);
+        else if (done)
+            memset((char *)buf + bytes_read, 0, bytes_from_block);
+        else
+            done = cache_peek(fs.data_idx + current_block, (char *)buf + bytes_read,
+                              offset_in_block, bytes_from_block, "fs_read") == 0;
+        if (done)
+        {
+            totalbytes -= bytes_from_block;
+            bytes_read += bytes_from_block;
+            offset_in_block = 0;
+            if (totalbytes > 0)
+                current_block = fd_block(fd, ++block_idx);
+            continue;
+        }
+
+        int count = 0, edges = 0;
+        size_t pos = bytes_read;
+        while (count < IO_BATCH && totalbytes > 0 && current_block != -1)
+        {
+            bytes_from_block = fs.block_size - offset_in_block;
+            if (bytes_from_block > totalbytes)
+                bytes_from_block = totalbytes;
+            if (count > 0 && (block_unwritten(current_block) ||
+                              cache_lookup_block(fs.data_idx + current_block)))
+                break; // leave cached and unwritten blocks to the fast path above
 
-    // Traverse FAT to find the correct starting block
-    while (block_offset >= BLOCK_SIZE && current_block != -1)
-    {
-        current_block = FAT[current_block]; // Move to the next block
-        block_offset--;
-    }
+            blocks[count] = fs.data_idx + current_block;
+            offs[count] = offset_in_block;
+            lens[count] = bytes_from_block;
+            if (bytes_from_block == (size_t)fs.block_size)
+                bufs[count] = (char *)buf + pos; // whole block goes straight to the caller
+            else
+                bufs[count] = edge[edges++];
+            count++;
 
-    size_t bytes_read = 0;
-   
+            pos += bytes_from_block;
+            totalbytes -= bytes_from_block;
+            offset_in_block = 0;
+            if (totalbytes > 0)
+                current_block = fd_block(fd, ++block_idx);
+        }
 
-    // Read the data block-by-block
-    while (totalbytes > 0 && current_block != -1)
-    { 
-        char block_data[BLOCK_SIZE];
-        if (block_read(fs.data_idx + current_block, block_data) != 0)
+        if (data_readv(blocks, bufs, count, "fs_read") != 0)
         {
             fprintf(stderr, "fs_read: Failed to read block from disk.\n");
             return -1;
         }
-        size_t bytes_from_block = BLOCK_SIZE - offset_in_block;
-        if (bytes_from_block > totalbytes)
+        int i;
+        for (i = 0; i < count; i++)
         {
-            bytes_from_block = totalbytes;
+            if (lens[i] != (size_t)fs.block_size)
+            {
+                memcpy((char *)buf + bytes_read, bufs[i] + offs[i], lens[i]);
+                // partial blocks are likely to be read again
+                cache_insert(blocks[i], bufs[i], "fs_read");
+            }
+            bytes_read += lens[i];
         }
+    }
 
-        memcpy((char *)buf + bytes_read, block_data + offset_in_block, bytes_from_block);
-        totalbytes -= bytes_from_block;
-        bytes_read += bytes_from_block;
-        offset_in_block = 0;
+    return bytes_read;
+}
 
-        current_block = FAT[current_block];
+int fs_read(int fildes, void *buf, size_t nbyte)
+{
+    struct file_descriptor *fd = fd_get(fildes, "fs_read");
+    if (fd == NULL)
+        return -1;
+    file_enter(fd, 0);
+    int ret = file_read(fd, buf, nbyte, fd->offset);
+    if (ret > 0)
+    {
+        read_ahead(fd, fd->offset, (fd->offset + ret - 1) / fs.block_size);
+        fd->offset += ret;
+        fd->ra_next = fd->offset;
     }
+    file_leave(fd);
+    return ret;
+}
 
-    fd->offset += bytes_read;
-
-    return bytes_read;
+/*Marks the blocks from first on of a write batch that held no file data before it, which idxs
+gives the logical index of (-1 for the others), as unwritten again, because the batch left them
+out. They read as the hole they were; the other blocks left out still hold their old data.*/
+static void unwrite_batch(const int *blocks, const int *idxs, int first, int n)
+{
+    int i;
+    pthread_mutex_lock(&meta_lock);
+    for (i = first; i < n; i++)
+        if (idxs[i] != -1)
+            lidx_set(blocks[i] - fs.data_idx, idxs[i] | LIDX_UNWRITTEN);
+    pthread_mutex_unlock(&meta_lock);
 }
 
-int fs_write(int fildes, void *buf, size_t nbyte)
+/*Writes at off to the file of fd, which is locked for writing; writing past the end leaves a
+hole behind. Like file_read, only the FAT cursor of fd moves. If the disk fills up, a write
+ends before the first whole block left out of a batch.*/
+static int file_write(struct file_descriptor *fd, void *buf, size_t nbyte, off_t off)
 {
-    // Validate file descriptor
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
+    struct dir_entry *file = &DIR[fd->file];
+    if (off > max_file_size() || nbyte > (size_t)(max_file_size() - off))
     {
-        fprintf(stderr, "fs_read: Invalid file descriptor.\n");
+        fprintf(stderr, "fs_write: File too large.\n");
         return -1;
     }
-    struct file_descriptor *fd = &fildesA[fildes];
-    struct dir_entry *file = &DIR[fd->file];
+    if (fs.comp_cluster)
+        return cluster_write(fd, buf, nbyte, off);
 
     size_t bytes_written = 0;
     size_t remaining_bytes = nbyte;
-    size_t offset_in_block = fd->offset%BLOCK_SIZE;
+    size_t offset_in_block = off % fs.block_size;
+    int block_idx = off / fs.block_size;
 
-    int current_block = file->head;
-
-    while (offset_in_block >= BLOCK_SIZE)
-    {
-        if (current_block == -1) break;
-        current_block = FAT[current_block];
-        offset_in_block -= BLOCK_SIZE;
-    }
+    // Find the starting block; in a hole or past the end the cursor is left on the block after
+    // which a new one is linked in
+    int current_block = fd_block(fd, block_idx);
 
-    int i;
+    // Whole blocks are written straight from the caller's buffer, in batches of vectored
+    // requests; partial blocks are merged in the cache
+    int blocks[IO_BATCH], idxs[IO_BATCH];
+    char *bufs[IO_BATCH];
+    int batched = 0;
 
     // Write data block by block
     while (remaining_bytes > 0)
     {
+        size_t bytes_in_block = fs.block_size - offset_in_block;
+        if (bytes_in_block > remaining_bytes) bytes_in_block = remaining_bytes;
+
+        struct delalloc *d = &dalloc[fd->file];
+        int pending = current_block == -1 && d->data != NULL && d->idx == block_idx;
+        if (pending && bytes_in_block == (size_t)fs.block_size)
+            dalloc_drop(fd->file); // overwritten as a whole
+        else if (current_block == -1 &&
+                 (pending || (delalloc_on && bytes_in_block < (size_t)fs.block_size))) {
+            // small write to a block the file does not have: buffer it, allocate later
+            if (dalloc_put(fd, block_idx, offset_in_block, (char *)buf + bytes_written,
+                           bytes_in_block) != 0)
+                break;
+            bytes_written += bytes_in_block;
+            remaining_bytes -= bytes_in_block;
+            offset_in_block = 0;
+            if (remaining_bytes > 0)
+                current_block = fd_block(fd, ++block_idx);
+            continue;
+        }
+
+        int fresh = 0; // block was just allocated and holds no file data yet
         if (current_block == -1) {
-            for (i = 0; i < DISK_BLOCKS; i++) {
-                if (FAT[i] == 0) {
-                    FAT[i] = -1;
-                    if (file->head == -1) file->head = i;
-                    else {
-                        int last_block = file->head;
-                        while (FAT[last_block] != -1) last_block = FAT[last_block];
-                        FAT[last_block] = i;
-                    }
-                    current_block = i;
-                    break;
-                }
+            pthread_mutex_lock(&meta_lock);
+            current_block = alloc_file_block(fd->file);
+            if (current_block != -1) {
+                lidx_set(current_block, block_idx);
+                link_block(fd, current_block, block_idx);
             }
+            pthread_mutex_unlock(&meta_lock);
             if (current_block == -1) {
-                fprintf(stderr, "fs_write: No space left on disk.\n");
-                return bytes_written;
+                no_space("fs_write");
+                break;
             }
+            fresh = 1;
         }
-
-        char block_data[BLOCK_SIZE];
-        if (block_read(fs.data_idx + current_block, block_data) != 0) {
-            memset(block_data, 0, BLOCK_SIZE); // Initialize new block
+        else if (block_unwritten(current_block)) { // preallocated, written for the first time
+            pthread_mutex_lock(&meta_lock);
+            lidx_set(current_block, block_idx);
+            pthread_mutex_unlock(&meta_lock);
+            fresh = 1;
         }
 
-        size_t bytes_in_block = BLOCK_SIZE - offset_in_block;
-        if (bytes_in_block > remaining_bytes) bytes_in_block = remaining_bytes;
-
-        memcpy(block_data + offset_in_block, (char *)buf + bytes_written, bytes_in_block);
-
-        if (block_write(fs.data_idx + current_block, block_data) != 0) {
+        if (bytes_in_block == (size_t)fs.block_size) {
+            cache_drop(fs.data_idx + current_block); // the cached copy is stale from now on
+            blocks[batched] = fs.data_idx + current_block;
+            idxs[batched] = fresh ? block_idx : -1;
+            bufs[batched++] = (char *)buf + bytes_written;
+        }
+        else if (!fresh && cache_own(fs.data_idx + current_block, fd->file, "fs_write") != 0) {
+            no_space("fs_write"); // a shared block gets its copy now, not when written back
+            break;
+        }
+        else if (cache_modify(fs.data_idx + current_block, fresh, offset_in_block,
+                              (char *)buf + bytes_written, bytes_in_block, fd->file,
+                              "fs_write") != 0) {
             fprintf(stderr, "fs_write: Failed to write block to disk.\n");
             return -1;
         }
@@ -466,53 +3394,185 @@ int fs_write(int fildes, void *buf, size_t nbyte)
         remaining_bytes -= bytes_in_block;
         offset_in_block = 0;
 
-        // Allocate next block if needed
-        if (remaining_bytes > 0) {
-            if (FAT[current_block] == -1) {
-                for (i = 0; i < DISK_BLOCKS; i++) {
-                    if (FAT[i] == 0) {
-                        FAT[current_block] = i;
-                        FAT[i] = -1;
-                        current_block = i;
-                        break;
-                    }
-                }
-                if (FAT[current_block] == -1) {
-                    fprintf(stderr, "fs_write: No space left on disk.\n");
-                    return bytes_written;
-                }
+        if (batched == IO_BATCH || (batched > 0 && remaining_bytes < (size_t)fs.block_size)) {
+            int done = data_writev(blocks, bufs, batched);
+            if (done == -1) {
+                fprintf(stderr, "fs_write: Failed to write block to disk.\n");
+                return -1;
             }
-            current_block = FAT[current_block];
+            if (done < batched) { // disk full
+                unwrite_batch(blocks, idxs, done, batched);
+                bytes_written -= (size_t)(batched - done) * fs.block_size;
+                batched = 0;
+                break;
+            }
+            batched = 0;
+        }
+
+        if (remaining_bytes > 0)
+            current_block = fd_block(fd, ++block_idx); // -1 in a hole, allocated above
+    }
+    if (batched > 0) { // stopped early, disk full
+        int done = data_writev(blocks, bufs, batched);
+        if (done == -1) {
+            fprintf(stderr, "fs_write: Failed to write block to disk.\n");
+            return -1;
         }
+        unwrite_batch(blocks, idxs, done, batched);
+        bytes_written -= (size_t)(batched - done) * fs.block_size;
     }
 
-    // Update file size and offset
-    fd->offset += bytes_written;
-    if (fd->offset > file->size)
-        file->size = fd->offset;
+    // Update file size, which a write that stopped before writing anything leaves alone
+    if (bytes_written > 0 && off + (off_t)bytes_written > file->size)
+    {
+        file->size = off + bytes_written;
+        pthread_mutex_lock(&meta_lock);
+        dir_touch(fd->file);
+        pthread_mutex_unlock(&meta_lock);
+    }
 
     return bytes_written;
 }
 
-int fs_get_filesize(int fildes)
+/*Returns 1 if a write that returned ret of nbyte bytes came up short while blocks freed since
+the last commit were held, after committing so that the rest can be written to them. Callers
+retry once at most. Called without ns_lock or any file lock.*/
+static int write_retry(int ret, size_t nbyte)
+{
+    if (ret != -1 && (size_t)ret == nbyte)
+        return 0;
+    pthread_rwlock_wrlock(&ns_lock);
+    int released = commit_freed();
+    pthread_rwlock_unlock(&ns_lock);
+    return released;
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte)
 {
-    // Validate file descriptor
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
+    int done = 0, ret, tries;
+    for (tries = 0;; tries++)
     {
-        fprintf(stderr, "fs_get_filesize: Invalid file descriptor.\n");
-        return -1;
+        struct file_descriptor *fd = fd_get(fildes, "fs_write");
+        if (fd == NULL)
+            return done > 0 ? done : -1;
+        file_enter(fd, 1);
+        ret = file_write(fd, (char *)buf + done, nbyte - done, fd->offset);
+        if (ret > 0)
+            fd->offset += ret;
+        file_leave(fd);
+        if (tries == 1 || !write_retry(ret, nbyte - done))
+            break;
+        done += ret > 0 ? ret : 0; // the rest goes to the blocks that were released
     }
-    struct file_descriptor *fd = &fildesA[fildes];
-    struct dir_entry *file = &DIR[fd->file];
+    return ret != -1 ? done + ret : done > 0 ? done : -1;
+}
+
+/*Carries out a positional transfer of the iovcnt buffers in iov, back to back from offset.
+The descriptor lock is given up as soon as the file is locked, so positional calls on one
+descriptor overlap; they move a private copy of its FAT cursor and leave its offset alone.*/
+static int positional(int fildes, const char *who, int wr, const struct iovec *iov, int iovcnt,
+                      off_t offset)
+{
+    struct iovec rest[iovcnt > 0 ? iovcnt : 1];
+    int done = 0, tries;
+    for (tries = 0;; tries++)
+    {
+        struct file_descriptor *fd = fd_get(fildes, who);
+        if (fd == NULL)
+            return done > 0 ? done : -1;
+        if (offset < 0 || offset > max_file_size() || iovcnt < 0)
+        {
+            pthread_mutex_unlock(&fd->lock);
+            fprintf(stderr, "%s: Invalid offset.\n", who);
+            return -1;
+        }
+        file_enter(fd, wr);
+        struct file_descriptor cur;
+        cur.file = fd->file;
+        cur.cur_block = fd->cur_block;
+        cur.cur_idx = fd->cur_idx;
+        pthread_mutex_unlock(&fd->lock);
+
+        int total = 0, i;
+        if (wr && offset > DIR[cur.file].size && fs.lidx_len == 0)
+        {
+            fprintf(stderr, "%s: Invalid offset.\n", who);
+            total = -1;
+        }
+        int n = 0;
+        for (i = 0; total != -1 && i < iovcnt; i++)
+        {
+            n = wr ? file_write(&cur, iov[i].iov_base, iov[i].iov_len, offset)
+                   : file_read(&cur, iov[i].iov_base, iov[i].iov_len, offset);
+            if (n == -1 || (size_t)n < iov[i].iov_len) // error, end of file, or disk full
+                break;
+            total += n;
+            offset += n;
+        }
+
+        pthread_rwlock_unlock(&file_lock[cur.file]);
+        pthread_rwlock_unlock(&ns_lock);
+        if (total == -1 || i == iovcnt)
+            return total != -1 ? done + total : done > 0 ? done : -1;
+        if (!wr || tries == 1 || !write_retry(n, iov[i].iov_len))
+            return n != -1 ? done + total + n : done > 0 ? done : -1;
+
+        // The rest goes to the blocks that were released
+        int got = n > 0 ? n : 0;
+        done += total + got;
+        offset += got;
+        memmove(rest, iov + i, (iovcnt - i) * sizeof(struct iovec));
+        rest[0].iov_base = (char *)rest[0].iov_base + got;
+        rest[0].iov_len -= got;
+        iov = rest;
+        iovcnt -= i;
+    }
+}
+
+/*Like fs_read and fs_write, but at offset instead of the descriptor's offset, which does not
+move.*/
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset)
+{
+    struct iovec iov = { buf, nbyte };
+    return positional(fildes, "fs_pread", 0, &iov, 1, offset);
+}
+
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset)
+{
+    struct iovec iov = { buf, nbyte };
+    return positional(fildes, "fs_pwrite", 1, &iov, 1, offset);
+}
+
+/*Scatter/gather forms of fs_pread and fs_pwrite: the iovcnt buffers of iov are filled or
+written in order, as one contiguous range of the file starting at offset.*/
+int fs_preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return positional(fildes, "fs_preadv", 0, iov, iovcnt, offset);
+}
+
+int fs_pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return positional(fildes, "fs_pwritev", 1, iov, iovcnt, offset);
+}
+
+off_t fs_get_filesize(int fildes)
+{
+    struct file_descriptor *fd = fd_get(fildes, "fs_get_filesize");
+    if (fd == NULL)
+        return -1;
+    file_enter(fd, 0);
+    off_t size = DIR[fd->file].size;
+    file_leave(fd);
 
-    return file->size;
+    return size;
 }
 
 int fs_listfiles(char ***files)
 {
     int i;
     int count = 0;
-    for (i = 0; i < MAX_FILES; i++) // count the number of files
+    pthread_rwlock_rdlock(&ns_lock);
+    for (i = 0; i < fs.dir_cap; i++) // count the number of files
     {
         if (DIR[i].used)
         {
@@ -523,11 +3583,12 @@ int fs_listfiles(char ***files)
     char **file_array = (char **)malloc((count + 1) * sizeof(char *)); //+ 1 for NULL
     if (file_array == NULL)
     {
+        pthread_rwlock_unlock(&ns_lock);
         return -1;
     }
 
     int index = 0;
-    for (i = 0; i < MAX_FILES; i++)
+    for (i = 0; i < fs.dir_cap; i++)
     {
         if (DIR[i].used)
         {
@@ -537,6 +3598,7 @@ int fs_listfiles(char ***files)
         }
     }
 
+    pthread_rwlock_unlock(&ns_lock);
     file_array[index] = NULL;
     *files = file_array;
 
@@ -545,76 +3607,553 @@ int fs_listfiles(char ***files)
 
 int fs_lseek(int fildes, off_t offset)
 {
-    // Validate file descriptor
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
-    {
-        fprintf(stderr, "fs_lseek: Invalid file descriptor.\n");
+    struct file_descriptor *fd = fd_get(fildes, "fs_lseek");
+    if (fd == NULL)
         return -1;
+    file_enter(fd, 0);
+    int ret = 0;
+
+    if (offset < 0 || offset > max_file_size() ||
+        (offset > DIR[fd->file].size && fs.lidx_len == 0))
+    {
+        fprintf(stderr, "fs_lseek: Invalid offset.\n");
+        ret = -1;
     }
-    struct file_descriptor *fd = &fildesA[fildes];
+    else
+        fd->offset = offset;
+
+    file_leave(fd);
+    return ret;
+}
+
+/*Truncates or extends the file of fd, which is locked for writing. Extending only moves the
+end of the file, so the new range is a hole.*/
+static int file_truncate(struct file_descriptor *fd, off_t length)
+{
     struct dir_entry *file = &DIR[fd->file];
 
-    if (offset < 0 || offset > file->size)
+    // Validate the length
+    if (length < 0 || length > max_file_size() || (length > file->size && fs.lidx_len == 0))
     {
-        fprintf(stderr, "fs_lseek: Invalid offset.\n");
+        fprintf(stderr, "fs_truncate: Invalid length.\n");
         return -1;
     }
+    if (length >= file->size)
+    {
+        file->size = length;
+        pthread_mutex_lock(&meta_lock);
+        dir_touch(fd->file);
+        pthread_mutex_unlock(&meta_lock);
+        return 0;
+    }
+
+    // Update the file pointer if it is beyond the new file length
+    if (fd->offset > length)
+    {
+        fd->offset = length;
+    }
+
+    int keep = (length + fs.block_size - 1) / fs.block_size; // blocks still needed
+    struct delalloc *d = &dalloc[fd->file];
+    size_t size = dalloc_size(), tail = length % size;
+    int unit = (length + size - 1) / size; // buffered blocks, or clusters, still needed
+    if (d->data != NULL && d->idx >= unit)
+        dalloc_drop(fd->file);
+    if (d->data != NULL && d->idx == unit - 1 && tail != 0)
+        memset(d->data + tail, 0, size - tail);
+    else if (fs.comp_cluster && tail != 0)
+    {
+        // A cluster cut in two is rewritten at once; on a full disk in the blocks it already
+        // has, so that the file can still shrink
+        char *c = (char *)malloc(size);
+        int ret = c == NULL ||
+                  cluster_load(fd, unit - 1, c, 0, fs.comp_cluster, "fs_truncate") != 0 ? -1 : 0;
+        if (ret == 0)
+        {
+            memset(c + tail, 0, size - tail);
+            ret = cluster_store(fd->file, unit - 1, c, 1, fd, "fs_truncate");
+        }
+        free(c);
+        if (ret != 0)
+            return -1;
+    }
+    if (fs.comp_cluster)
+        keep = unit * fs.comp_cluster; // the blocks of the cut cluster stay with it
+
+    int current_block = -1;
+    int next_block = file->head;
+    int i;
+
+    // Traverse to the last block covered by the new file length
+    while (next_block != -1 && block_index(next_block) < keep)
+    {
+        current_block = next_block;
+        next_block = FAT[current_block];
+    }
+
+    // Bytes past the new end of its last block must read back as zeros if the file grows again
+    if (!fs.comp_cluster && length % fs.block_size != 0 && current_block != -1 &&
+        block_index(current_block) == keep - 1 && !block_unwritten(current_block))
+    {
+        size_t off = length % fs.block_size;
+        char zeros[fs.block_size - off];
+        memset(zeros, 0, sizeof(zeros));
+        if (cache_own(fs.data_idx + current_block, fd->file, "fs_truncate") != 0)
+        {
+            no_space("fs_truncate");
+            return -1;
+        }
+        if (cache_modify(fs.data_idx + current_block, 0, off, zeros, sizeof(zeros), fd->file,
+                         "fs_truncate") != 0)
+        {
+            fprintf(stderr, "fs_truncate: Failed to write block to disk.\n");
+            return -1;
+        }
+    }
+
+    // Terminate the file at that block and free the blocks after it
+    pthread_mutex_lock(&meta_lock);
+    if (current_block == -1)
+        file->head = -1;
+    else
+        fat_set(current_block, -1);
+    tail_block[fd->file] = current_block;
+    release_resv(fd->file);
+    while (next_block != -1)
+    {
+        int temp_block = next_block;
+        next_block = FAT[next_block];
+        free_block(temp_block); // Free the block
+    }
+    dir_touch(fd->file);
+    pthread_mutex_unlock(&meta_lock);
 
-    fd->offset = offset;
+    // Cursors on freed blocks fall back to the head of the file
+    for (i = 0; i < MAX_FD; i++)
+    {
+        if (fildesA[i].used && fildesA[i].file == fd->file && fildesA[i].cur_idx >= keep)
+            fildesA[i].cur_block = -1;
+    }
+
+    file->size = length;
 
     return 0;
 }
 
 int fs_truncate(int fildes, off_t length)
 {
-    // Validate file descriptor
-    if (fildes < 0 || fildes >= MAX_FD || !fildesA[fildes].used)
+    int ret, tries;
+    for (tries = 0;; tries++)
     {
-        fprintf(stderr, "fs_read: Invalid file descriptor.\n");
-        return -1;
+        struct file_descriptor *fd = fd_get(fildes, "fs_truncate");
+        if (fd == NULL)
+            return -1;
+        file_enter(fd, 1);
+        ret = file_truncate(fd, length);
+        file_leave(fd);
+        if (ret == 0 || tries == 1 || !write_retry(-1, 0)) // a shared block cut in two needs a copy
+            return ret;
     }
+}
 
-    struct file_descriptor *fd = &fildesA[fildes];
-    struct dir_entry *file = &DIR[fd->file];
+/*Reserves a block for every hole in [offset, offset + len) of the file of fd, which is locked
+for writing. The missing blocks are taken as one free run when the disk has one, and block by
+block otherwise; on a full disk the blocks reserved so far are kept. Without FS_FALLOC_ZERO the
+blocks are only marked unwritten, so nothing is written to them. Whatever ends the call, the
+part of the run it did not link is freed.*/
+static int file_fallocate(struct file_descriptor *fd, off_t offset, off_t len, int flags)
+{
+    int first = offset / fs.block_size;
+    int last = (offset + len - 1) / fs.block_size;
+    if (dalloc_flush(fd->file, fd) != 0) // a buffered block gets its block first
+        return -1;
 
-    // Validate the length
-    if (length > file->size)
+    // Count the blocks the range already has
+    fd_block(fd, first);
+    int block = fd->cur_block == -1 ? DIR[fd->file].head : fd->cur_block;
+    int missing = last - first + 1;
+    for (; block != -1 && block_index(block) <= last; block = FAT[block])
+        if (block_index(block) >= first)
+            missing--;
+
+    char *zeros = NULL;
+    if ((flags & FS_FALLOC_ZERO) && (zeros = (char *)calloc(1, fs.block_size)) == NULL)
+        return -1;
+
+    pthread_mutex_lock(&meta_lock);
+    int run = missing > 0 && room_for(missing) ? find_free_run(missing) : -1;
+    int run_end = run + missing;
+    int i;
+    for (i = 0; run != -1 && i < missing; i++)
+        take_block(run + i);
+    pthread_mutex_unlock(&meta_lock);
+    int blocks[IO_BATCH], idxs[IO_BATCH];
+    char *bufs[IO_BATCH];
+    int idx = first, ret = 0;
+    while (idx <= last && ret == 0)
     {
-        fprintf(stderr, "fs_truncate: Invalid length.\n");
+        // Link up to a batch of blocks, then zero the batch if asked to
+        int n = 0;
+        pthread_mutex_lock(&meta_lock);
+        for (; idx <= last && n < IO_BATCH; idx++)
+        {
+            block = fd_block(fd, idx);
+            if (block == -1)
+            {
+                block = run != -1 && run < run_end ? run++ : alloc_block();
+                if (block == -1)
+                {
+                    ret = -1;
+                    break;
+                }
+                lidx_set(block, idx | LIDX_UNWRITTEN);
+                link_block(fd, block, idx);
+            }
+            else if (!block_unwritten(block))
+                continue;
+            if (zeros != NULL)
+            {
+                blocks[n] = fs.data_idx + block;
+                bufs[n] = zeros;
+                idxs[n++] = idx;
+            }
+        }
+        pthread_mutex_unlock(&meta_lock);
+        if (ret != 0)
+            no_space("fs_fallocate");
+
+        for (i = 0; i < n; i++)
+            cache_drop(blocks[i]); // stale slots of the last owners must not be written back
+        if (n > 0 && data_writev(blocks, bufs, n) != n)
+        {
+            fprintf(stderr, "fs_fallocate: Failed to write block to disk.\n");
+            ret = -1;
+        }
+        else if (n > 0)
+        {
+            pthread_mutex_lock(&meta_lock);
+            for (i = 0; i < n; i++)
+                lidx_set(blocks[i] - fs.data_idx, idxs[i]);
+            pthread_mutex_unlock(&meta_lock);
+        }
+    }
+    if (run != -1 && run < run_end)
+    {
+        pthread_mutex_lock(&meta_lock);
+        while (run < run_end)
+            free_block(run++);
+        pthread_mutex_unlock(&meta_lock);
+    }
+    free(zeros);
+    return ret;
+}
+
+/*Reserves the blocks of [offset, offset + len) in the file behind fildes, in one allocator pass
+and contiguously where possible, without changing its size. Until they are written the blocks
+read back as zeros; FS_FALLOC_ZERO also writes zeros to them. Returns 0 on success, -1 on
+failure.*/
+int fs_fallocate(int fildes, off_t offset, off_t len, int flags)
+{
+    int ret, tries;
+    struct file_descriptor *fd = fd_get(fildes, "fs_fallocate");
+    if (fd == NULL)
+        return -1;
+    if (offset < 0 || len <= 0 || offset > max_file_size() || len > max_file_size() - offset ||
+        fs.lidx_len == 0)
+    {
+        pthread_mutex_unlock(&fd->lock);
+        fprintf(stderr, "fs_fallocate: Invalid range.\n");
+        return -1;
+    }
+    if (fs.comp_cluster) // clusters are rewritten as a whole, so blocks cannot be set aside
+    {
+        pthread_mutex_unlock(&fd->lock);
+        fprintf(stderr, "fs_fallocate: Not supported on a compressed file system.\n");
+        return -1;
+    }
+    if (fs.pmap_len > 0) // data blocks are chosen when written, so they cannot be set aside
+    {
+        pthread_mutex_unlock(&fd->lock);
+        fprintf(stderr, "fs_fallocate: Not supported on a deduplicating file system.\n");
         return -1;
     }
+    for (tries = 0;; tries++)
+    {
+        file_enter(fd, 1);
+        ret = file_fallocate(fd, offset, len, flags);
+        file_leave(fd);
+        if (ret == 0 || tries == 1 || !write_retry(-1, 0)) // the blocks reserved so far are kept
+            return ret;
+        if ((fd = fd_get(fildes, "fs_fallocate")) == NULL)
+            return -1;
+    }
+}
 
-    // Update the file pointer if it is beyond the new file length
-    if (fd->offset > length)
+/*Adds the blocks of file filenum and the runs of adjacent disk blocks they form, in file order,
+to frag. Returns 1 if the file holds any blocks, 0 if it is empty.*/
+static int frag_count(int filenum, struct fs_frag *frag)
+{
+    int block, prev = -2;
+    long long blocks = 0, extents = 0;
+    for (block = DIR[filenum].head; block != -1; block = FAT[block])
     {
-        fd->offset = length;
+        int p = data_block(fs.data_idx + block);
+        if (p != prev + 1)
+            extents++;
+        prev = p;
+        blocks++;
     }
+    frag->files++;
+    frag->blocks += blocks;
+    frag->extents += extents;
+    return blocks > 0;
+}
 
-    int current_block = file->head;
-    size_t offset_in_block = length;
+/*Reports the fragmentation of the file name, or of every file if name is NULL. The score is
+the share of pairs of consecutive blocks within a file that are not adjacent on the disk: 0 when
+every file is one contiguous run, 1 when no two of its blocks are. Returns 0 on success, -1 on
+failure.*/
+int fs_fragmentation(char *name, struct fs_frag *frag)
+{
+    memset(frag, 0, sizeof(*frag));
+    if (FAT == NULL)
+    {
+        fprintf(stderr, "fs_fragmentation: No file system is mounted.\n");
+        return -1;
+    }
+    pthread_rwlock_rdlock(&ns_lock);
+    int i, found = name == NULL, nonempty = 0;
+    for (i = name == NULL ? 0 : dir_lookup(name); i != -1 && i < fs.dir_cap; i++)
+    {
+        if (!DIR[i].used)
+            continue;
+        pthread_rwlock_rdlock(&file_lock[i]);
+        nonempty += frag_count(i, frag);
+        pthread_rwlock_unlock(&file_lock[i]);
+        found = 1;
+        if (name != NULL)
+            break;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    if (!found)
+    {
+        fprintf(stderr, "fs_fragmentation: File '%s' not found.\n", name);
+        return -1;
+    }
+    long long pairs = frag->blocks - nonempty; // one extent per non-empty file is unavoidable
+    frag->score = pairs > 0 ? (double)(frag->extents - nonempty) / pairs : 0;
+    return 0;
+}
 
-    // Traverse to the block corresponding to the new file length
-    while (offset_in_block >= BLOCK_SIZE && current_block != -1)
+/*Returns the blocks taken by defrag_take. Called with meta_lock held.*/
+static void defrag_give(const int *blocks, int n)
+{
+    int i;
+    pthread_mutex_lock(&dedup_lock);
+    for (i = 0; i < n; i++)
     {
-        current_block = FAT[current_block];
-        offset_in_block -= BLOCK_SIZE;
+        if (fs.pmap_len > 0)
+            phys_put(blocks[i]);
+        else
+        {
+            used_map[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+            free_blocks++;
+        }
     }
+    pthread_mutex_unlock(&dedup_lock);
+}
 
-    // Free any blocks after the truncation point
-    if (current_block != -1)
+/*Takes len free blocks for a file that is being moved, in as few runs as the free space allows,
+and lists them in blocks: FAT entries, or data blocks on a dedup disk. Returns the number of
+runs, or -1 if there are not enough free blocks. Called with meta_lock held.*/
+static int defrag_take(int *blocks, int len)
+{
+    int got = 0, runs = 0, run = len, i;
+    while (got < len && run > 0)
     {
-        int next_block = FAT[current_block];
-        FAT[current_block] = -1; // Terminate the file at this block
+        int start = -1;
+        if (run > len - got)
+            run = len - got;
+        if (fs.pmap_len > 0)
+        {
+            pthread_mutex_lock(&dedup_lock);
+            start = phys_run(run);
+            pthread_mutex_unlock(&dedup_lock);
+        }
+        else if (room_for(run) && (start = find_free_run(run)) != -1)
+            for (i = start; i < start + run; i++)
+                take_block(i);
+        if (start == -1)
+        {
+            run /= 2; // settle for shorter runs
+            continue;
+        }
+        for (i = 0; i < run; i++)
+            blocks[got++] = start + i;
+        runs++;
+    }
+    if (got == len)
+        return runs;
+    defrag_give(blocks, got);
+    return -1;
+}
 
-        while (next_block != -1)
+/*Copies the n blocks of the file listed in entry, FAT entries in file order, to the blocks in
+moved: FAT entries, or data blocks on a dedup disk. Blocks reserved by fs_fallocate hold no
+data and are skipped.*/
+static int defrag_copy(const int *entry, const int *moved, int n)
+{
+    char *data = (char *)malloc((size_t)IO_BATCH * fs.block_size);
+    int from[IO_BATCH], to[IO_BATCH];
+    char *bufs[IO_BATCH];
+    int i, j, m, ret = data == NULL ? -1 : 0;
+    for (i = 0; i < n && ret == 0; i += IO_BATCH)
+    {
+        for (j = i, m = 0; j < n && j < i + IO_BATCH; j++)
         {
-            int temp_block = next_block;
-            next_block = FAT[next_block];
-            FAT[temp_block] = 0; // Free the block
+            if (block_unwritten(entry[j]))
+                continue;
+            from[m] = fs.data_idx + entry[j];
+            to[m] = fs.data_idx + moved[j];
+            bufs[m] = data + (size_t)m * fs.block_size;
+            if (fs.pmap_len == 0)
+                cache_drop(to[m]); // may be cached from a previous owner
+            m++;
         }
+        if (m == 0)
+            continue;
+        if (data_readv(from, bufs, m, "fs_defrag") != 0)
+            ret = -1;
+        else if (fs.pmap_len > 0) // moved holds data blocks, written without the dedup lookup
+            ret = block_writev(to, bufs, m) != 0 || csum_update(to, bufs, m) != 0 ? -1 : 0;
+        else
+            ret = data_writev(to, bufs, m) == m ? 0 : -1;
     }
+    free(data);
+    return ret;
+}
 
-    file->size = length;
+/*Moves the blocks of file filenum, in file order, into as few runs of adjacent disk blocks as
+the free space allows, if that gives fewer runs than the file has now. The blocks are copied to
+new FAT entries and the chain is rewritten; on a dedup disk the FAT entries stay instead, and
+only the data blocks the file does not share are moved. The old blocks are freed and the new
+metadata is committed before the caller gives up ns_lock, which it holds exclusively, so no
+other file can reuse them first and a crash leaves the file in one place or the other.*/
+static int defrag_file(int filenum)
+{
+    struct fs_frag frag;
+    memset(&frag, 0, sizeof(frag));
+    if (dalloc_flush(filenum, NULL) != 0 || cache_flush(filenum) != 0)
+        return -1;
+    frag_count(filenum, &frag);
+    if (frag.extents <= 1)
+        return 0;
 
-    return 0;
+    int *entry = (int *)malloc(frag.blocks * sizeof(int));
+    int *moved = (int *)malloc(frag.blocks * sizeof(int));
+    int n = 0, i, block, ret = -1;
+    if (entry == NULL || moved == NULL)
+        goto out;
+    for (block = DIR[filenum].head; block != -1; block = FAT[block])
+    {
+        int phys = fs.pmap_len > 0 ? PMAP[block] : block;
+        if (fs.pmap_len == 0 || REFS[phys] == 1)
+            entry[n++] = block;
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    int runs = n > 0 ? defrag_take(moved, n) : -1;
+    if (runs >= frag.extents)
+        defrag_give(moved, n); // no better than before
+    pthread_mutex_unlock(&meta_lock);
+    if (runs == -1 || runs >= frag.extents)
+    {
+        ret = 0; // nothing to gain, or no room to do it
+        goto out;
+    }
+    if (defrag_copy(entry, moved, n) != 0)
+    {
+        pthread_mutex_lock(&meta_lock);
+        defrag_give(moved, n);
+        pthread_mutex_unlock(&meta_lock);
+        fprintf(stderr, "fs_defrag: Failed to move the blocks of '%s'.\n", DIR[filenum].name);
+        goto out;
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    if (fs.pmap_len > 0)
+    {
+        pthread_mutex_lock(&dedup_lock);
+        for (i = 0; i < n; i++)
+        {
+            phys_put(PMAP[entry[i]]);
+            pmap_set(entry[i], moved[i]);
+            fp_insert(moved[i]);
+        }
+        pthread_mutex_unlock(&dedup_lock);
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            lidx_set(moved[i], LIDX[entry[i]]);
+            fat_set(moved[i], i + 1 < n ? moved[i + 1] : -1);
+        }
+        DIR[filenum].head = moved[0];
+        dir_touch(filenum);
+        tail_block[filenum] = moved[n - 1];
+        for (i = 0; i < n; i++)
+        {
+            free_block(entry[i]);
+            cache_drop(fs.data_idx + entry[i]);
+        }
+        for (i = 0; i < MAX_FD; i++)
+            if (fildesA[i].used && fildesA[i].file == filenum)
+                fildesA[i].cur_block = -1;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    ret = disk_sync() != 0 || sync_meta() != 0 || disk_sync() != 0 ? -1 : 0;
+out:
+    free(entry);
+    free(moved);
+    return ret;
+}
+
+/*Defragments the file name, or every file if name is NULL, moving the blocks of each file into
+contiguous runs and committing the result file by file. Only one file is locked at a time, so
+the file system stays in use while a whole disk is defragmented; open files are moved too.
+Returns 0 on success, -1 on failure.*/
+int fs_defrag(char *name)
+{
+    if (FAT == NULL)
+    {
+        fprintf(stderr, "fs_defrag: No file system is mounted.\n");
+        return -1;
+    }
+    int i, ret = 0;
+    if (name != NULL)
+    {
+        pthread_rwlock_wrlock(&ns_lock);
+        i = dir_lookup(name);
+        if (i != -1)
+            ret = defrag_file(i);
+        pthread_rwlock_unlock(&ns_lock);
+        if (i == -1)
+        {
+            fprintf(stderr, "fs_defrag: File '%s' not found.\n", name);
+            return -1;
+        }
+        return ret;
+    }
+    for (i = 0;; i++)
+    {
+        pthread_rwlock_wrlock(&ns_lock);
+        int cap = fs.dir_cap;
+        if (i < cap && DIR[i].used && defrag_file(i) != 0)
+            ret = -1;
+        pthread_rwlock_unlock(&ns_lock);
+        if (i + 1 >= cap)
+            break;
+    }
+    return ret;
 }
@@ -5,21 +5,67 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#define FS_ALLOC_FIRST_FIT 0 // take the first free block found (default)
+#define FS_ALLOC_EXTENT    1 // reserve contiguous runs per file, next-fit
 
+#define FS_FALLOC_ZERO 1 // fs_fallocate: also write zeros to the reserved blocks
+
+/* Format-time options for make_fs_opts; zeroed fields select the defaults. */
+struct fs_options
+{
+    int alloc_policy;  // FS_ALLOC_FIRST_FIT or FS_ALLOC_EXTENT
+    int extent_blocks; // blocks reserved per extent under FS_ALLOC_EXTENT
+    int block_size;    // bytes per block, a power of two from 1 KiB to 64 KiB
+    long long disk_size; // bytes on the disk, rounded down to whole blocks
+    int journal_blocks;  // metadata journal length, -1 for no journal; it must hold a change to
+                         // every table block, which make_fs_opts reports if it cannot
+    int checksums;       // 0 keeps a CRC32C of every data block, -1 keeps none
+    int compress;        // blocks per compression cluster, a power of two from 2 to 16; 0 stores
+                         // file data raw
+    int dedup;           // 0 stores every block written; n from 1 to 16 stores identical blocks
+                         // once and lets files hold up to n times as many blocks as the disk
+};
+
+/* Fragmentation reported by fs_fragmentation. */
+struct fs_frag
+{
+    int files;         // files counted
+    long long blocks;  // blocks they hold
+    long long extents; // runs of adjacent disk blocks those form, taken in file order
+    double score;      // 0 if every file is one run, 1 if no two consecutive blocks are adjacent
+};
+
+/* Every call below may be made from several threads at once, except make_fs, make_fs_opts,
+   mount_fs and umount_fs, which must not overlap with any other call. */
 int make_fs(char *disk_name);
+int make_fs_opts(char *disk_name, struct fs_options *opts);
 int mount_fs(char *disk_name);
 int umount_fs(char *disk_name);
 int fs_open(char *name);
 int fs_close(int fildes);
 int fs_create(char *name);
 int fs_delete(char *name);
+int fs_clone(char *src, char *dst);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
-int fs_get_filesize(int fildes);
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset);
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset);
+int fs_preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+int fs_pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+off_t fs_get_filesize(int fildes);
 int fs_listfiles(char ***files);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
+int fs_fallocate(int fildes, off_t offset, off_t len, int flags);
+int fs_flush(void);
+int fs_sync(void);
+int fs_fsync(int fildes);
+int fs_set_cache_size(int nblocks);
+int fs_set_delalloc(int enable);
+int fs_fragmentation(char *name, struct fs_frag *frag);
+int fs_defrag(char *name);
 
 #endif
\ No newline at end of file
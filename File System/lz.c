@@ -0,0 +1,157 @@
+#include <string.h>
+
+#include "lz.h"
+
+/******************************************************************************/
+/* An LZ77 codec in the style of LZ4. The stream is a series of sequences,    */
+/* each a token byte, literals and a match. The token's high nibble is the    */
+/* literal count and its low nibble the match length minus MIN_MATCH; a       */
+/* nibble of 15 is extended by bytes of 255 and a final byte below 255. The   */
+/* literals follow, then the match offset in two bytes, little-endian, then   */
+/* the extended match length. The last sequence ends after its literals.      */
+/******************************************************************************/
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static unsigned int hash(const unsigned char *p)
+{
+  unsigned int v;
+
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Appends a length extension of n to out, which ends at end. */
+static unsigned char *put_len(unsigned char *out, unsigned char *end, int n)
+{
+  for (; n >= 255; n -= 255) {
+    if (out == end)
+      return NULL;
+    *out++ = 255;
+  }
+  if (out == end)
+    return NULL;
+  *out++ = n;
+  return out;
+}
+
+/* Appends a sequence of nlit literals and, if mlen is not 0, a match. */
+static unsigned char *put_seq(unsigned char *out, unsigned char *end,
+                              const unsigned char *lit, int nlit, int off, int mlen)
+{
+  int m = mlen ? mlen - MIN_MATCH : 0;
+
+  if (out == end)
+    return NULL;
+  *out++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+  if (nlit >= 15 && (out = put_len(out, end, nlit - 15)) == NULL)
+    return NULL;
+  if (end - out < nlit)
+    return NULL;
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (mlen == 0)
+    return out;
+  if (end - out < 2)
+    return NULL;
+  *out++ = off & 0xff;
+  *out++ = off >> 8;
+  if (m >= 15 && (out = put_len(out, end, m - 15)) == NULL)
+    return NULL;
+  return out;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap)
+{
+  const unsigned char *in = src;
+  unsigned char *out = dst, *end = out + cap;
+  int table[1 << HASH_BITS];
+  int pos = 0, anchor = 0, i;
+
+  for (i = 0; i < 1 << HASH_BITS; ++i)
+    table[i] = -1;
+
+  while (pos + MIN_MATCH <= len) {
+    unsigned int h = hash(in + pos);
+    int cand = table[h];
+
+    table[h] = pos;
+    if (cand < 0 || pos - cand > MAX_OFFSET || memcmp(in + cand, in + pos, MIN_MATCH) != 0) {
+      ++pos;
+      continue;
+    }
+
+    int mlen = MIN_MATCH;
+    while (pos + mlen < len && in[cand + mlen] == in[pos + mlen])
+      ++mlen;
+    if ((out = put_seq(out, end, in + anchor, pos - anchor, pos - cand, mlen)) == NULL)
+      return -1;
+    pos += mlen;
+    anchor = pos;
+  }
+
+  if ((out = put_seq(out, end, in + anchor, len - anchor, 0, 0)) == NULL)
+    return -1;
+  return out - (unsigned char *)dst;
+}
+
+/* Reads a length extension from *in, which ends at end; -1 if it runs off. */
+static int get_len(const unsigned char **in, const unsigned char *end)
+{
+  int n = 0;
+  unsigned char b;
+
+  do {
+    if (*in == end || n > (1 << 30))
+      return -1;
+    b = *(*in)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap)
+{
+  const unsigned char *in = src, *iend = in + len;
+  unsigned char *out = dst, *oend = out + cap;
+
+  while (in < iend) {
+    int token = *in++;
+    int nlit = token >> 4, mlen = token & 15, off, n;
+
+    if (nlit == 15) {
+      if ((n = get_len(&in, iend)) < 0)
+        return -1;
+      nlit += n;
+    }
+    if (nlit > iend - in || nlit > oend - out)
+      return -1;
+    memcpy(out, in, nlit);
+    in += nlit;
+    out += nlit;
+    if (in == iend)
+      break; /* last sequence */
+
+    if (iend - in < 2)
+      return -1;
+    off = in[0] | in[1] << 8;
+    in += 2;
+    if (mlen == 15) {
+      if ((n = get_len(&in, iend)) < 0)
+        return -1;
+      mlen += n;
+    }
+    mlen += MIN_MATCH;
+    if (off == 0 || off > out - (unsigned char *)dst || mlen > oend - out)
+      return -1;
+    if (off >= mlen)
+      memcpy(out, out - off, mlen);
+    else
+      for (n = 0; n < mlen; ++n) /* overlapping match repeats the last off bytes */
+        out[n] = out[n - off];
+    out += mlen;
+  }
+
+  return out - (unsigned char *)dst;
+}
@@ -0,0 +1,15 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/******************************************************************************/
+int lz_compress(const void *src, int len, void *dst, int cap);
+                               /* compress len bytes of src into at most cap  */
+                               /* bytes of dst; returns the compressed length */
+                               /* or -1 if it does not fit                    */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+                               /* expand len bytes of src into at most cap    */
+                               /* bytes of dst; returns the expanded length   */
+                               /* or -1 if src is malformed or too long       */
+/******************************************************************************/
+
+#endif